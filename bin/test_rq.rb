@@ -100,6 +100,11 @@ status = rq_status()
 p status
 test_equal(__LINE__,status["jobs"]['total'],2)
 
+# report on the queue lock while the feeder is running
+locks = YAML.load(`#{$rq} #{$queue} locks`)
+error(__LINE__,"locks failed") if !$?.success? or !locks.is_a?(Hash)
+test_equal(__LINE__,locks.keys.include?('holding'),true)
+
 # Now add longer jobs
 rq_exec('submit "sleep 30"')  # does not finish 
 sleep(1)
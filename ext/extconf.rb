@@ -5,11 +5,24 @@ sqlite_dir = "sqlite-2.8.17"
 path_to_sqlite = path+"/"+sqlite_dir
 
 Dir.chdir path_to_sqlite
-system "./configure --prefix="+path_to_sqlite
+# the binding runs the engine without the interpreter lock held, so sqlite
+# must guard its own process wide state (the inode lock table) with a mutex
+system "config_TARGET_CFLAGS='-g -O2 -DTHREADSAFE=1' ./configure --prefix="+path_to_sqlite
 system "make && make install"
 
 Dir.chdir path
 
+# releasing the interpreter lock around sqlite_exec/sqlite_step (ruby >= 2.0)
+have_header("ruby/thread.h")
+have_func("rb_thread_call_without_gvl2", "ruby/thread.h")
+have_func("rb_thread_call_with_gvl", "ruby/thread.h")
+have_library("pthread")
+have_header("pthread.h")
+
+# open file description locks and flock
+have_header("sys/file.h")
+have_func("flock")
+
 if (find_library("sqlite","sqlite_open",path_to_sqlite+"/lib") and
     find_library("sqlite","main",path_to_sqlite+"/lib") and 
     find_header("sqlite.h",path_to_sqlite+"/include"))
@@ -1,8 +1,13 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1           /* for F_OFD_SETLK */
+#endif
+
 #ifdef _WIN32
 #include "missing/file.h"
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <ruby.h>
 #include <ruby/io.h>
@@ -22,9 +27,31 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_FILE_H
+#include <sys/file.h>
+#endif
+
 #include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+
+/* blocking in fcntl without the interpreter lock (ruby >= 2.0) */
+#if defined(HAVE_RUBY_THREAD_H) && defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL2)
+#include <ruby/thread.h>
+#include <pthread.h>
+#define POSIXLOCK_RELEASE_GVL 1
+#endif
+
+/* keeping a lockfile fresh from a native thread */
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#define POSIXLOCK_LEASE 1
+#endif
 
 extern VALUE rb_cFile;
+#ifdef POSIXLOCK_LEASE
+static VALUE rb_cFile_Lease;
+#endif
 static VALUE rb_cFile_F_LOCK;
 static VALUE rb_cFile_F_LOCKR;
 static VALUE rb_cFile_F_LOCKW;
@@ -49,6 +76,26 @@ static VALUE rb_cFile_F_TESTW;
 #  define LOCK_UN 8
 # endif
 
+/* or'd into a posixlock operation to choose the kind of lock taken: open
+ * file description locks (F_OFD_SETLK, linux >= 3.15) belong to the open
+ * file rather than the process, so they survive the process closing some
+ * other descriptor for the file and can be held by threads independently,
+ * yet conflict with classic fcntl locks as usual.  flock locks are cheaper
+ * still but are only seen by other flock users, and don't work over nfs */
+#define LOCK_OFD 16
+#define LOCK_FLOCK 32
+
+/* or'd in to lock the intent byte rather than the whole file.  taking it
+ * before the lock proper, and dropping it once that is granted, makes the
+ * lock prefer writers: a writer waiting for readers to finish holds the
+ * intent byte, so readers coming after queue behind the writer instead of
+ * joining those reading.  it lies far past any data and, being a byte range,
+ * is always an fcntl lock (ofd where there are such) even for flock users */
+#define LOCK_INTENT 64
+#define POSIXLOCK_INTENT_BYTE 0x40000000L
+
+#define LOCK_MODES (LOCK_OFD | LOCK_FLOCK | LOCK_INTENT)
+
 #ifndef F_LOCK
 #define F_LOCK 1
 #endif
@@ -82,12 +129,37 @@ static VALUE rb_cFile_F_TESTW;
 
 
 
+/* the bytes a lock covers: the whole file, or just the intent byte */
+static void
+posixlock_range (lock, mode)
+     struct flock *lock;
+     int mode;
+{
+  lock->l_whence = SEEK_SET;
+  if (mode & LOCK_INTENT)
+    {
+      lock->l_start = POSIXLOCK_INTENT_BYTE;
+      lock->l_len = 1L;
+    }
+  else
+    lock->l_start = lock->l_len = 0L;
+}
+
+
 static int
 posixlock (fd, operation)
      int fd;
      int operation;
 {
   struct flock lock;
+  int mode = operation & LOCK_MODES;
+
+  operation &= ~LOCK_MODES;
+
+#ifdef HAVE_FLOCK
+  if ((mode & LOCK_FLOCK) && !(mode & LOCK_INTENT))
+    return flock (fd, operation);
+#endif
 
   switch (operation & ~LOCK_NB)
     {
@@ -104,12 +176,53 @@ posixlock (fd, operation)
       errno = EINVAL;
       return -1;
     }
-  lock.l_whence = SEEK_SET;
-  lock.l_start = lock.l_len = 0L;
+  posixlock_range (&lock, mode);
+#ifdef F_OFD_SETLK
+  if (mode & (LOCK_OFD | LOCK_FLOCK))
+    {
+      int ret;
+
+      lock.l_pid = 0;
+      ret = fcntl (fd, (operation & LOCK_NB) ? F_OFD_SETLK : F_OFD_SETLKW, &lock);
+      /* EINVAL: a kernel without them, so take a classic lock instead */
+      if (ret == 0 || errno != EINVAL)
+	return ret;
+    }
+#endif
   return fcntl (fd, (operation & LOCK_NB) ? F_SETLK : F_SETLKW, &lock);
 }
 
 
+/* the pid holding a lock that conflicts with operation, -1 for an open file
+ * description lock (which has no single owner), or 0 if there is none */
+static int
+posixlock_holder (fd, operation, holder)
+     int fd;
+     int operation;
+     int *holder;
+{
+  struct flock lock;
+  int ret;
+
+  lock.l_type = ((operation & ~(LOCK_MODES | LOCK_NB)) == LOCK_SH) ? F_RDLCK : F_WRLCK;
+  posixlock_range (&lock, operation);
+  lock.l_pid = 0;
+#ifdef F_OFD_GETLK
+  if (operation & (LOCK_OFD | LOCK_FLOCK))
+    {
+      ret = fcntl (fd, F_OFD_GETLK, &lock);
+      if (ret != 0 && errno == EINVAL)
+	ret = fcntl (fd, F_GETLK, &lock);
+    }
+  else
+#endif
+    ret = fcntl (fd, F_GETLK, &lock);
+  if (ret == 0)
+    *holder = (lock.l_type == F_UNLCK) ? 0 : lock.l_pid;
+  return ret;
+}
+
+
 static VALUE
 rb_file_posixlock (obj, operation)
      VALUE obj;
@@ -155,6 +268,651 @@ retry:
 }
 
 
+/*
+ * File#posixlock_timeout waits for a lock by blocking in F_SETLKW, so it is
+ * granted the moment it is released rather than at the next poll.  The wait
+ * happens without the interpreter lock.  The interpreter wakes the waiter for
+ * its own interrupts with SIGVTALRM, and a watchdog thread does the same when
+ * the deadline passes; either way fcntl returns EINTR.
+ */
+#ifdef POSIXLOCK_RELEASE_GVL
+struct posixlock_wait
+{
+  int fd;
+  int operation;
+  int ret;
+  int err;
+  int entered;                  /* the interpreter let us wait at all */
+  int done;                     /* fcntl has returned */
+  int timed_out;                /* the watchdog fired */
+  pthread_t waiter;
+  struct timespec deadline;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+
+static void *
+posixlock_blocking (arg)
+     void *arg;
+{
+  struct posixlock_wait *w = (struct posixlock_wait *) arg;
+
+  w->entered = 1;
+  w->ret = posixlock (w->fd, w->operation & ~LOCK_NB);
+  w->err = errno;
+
+  pthread_mutex_lock (&w->mutex);
+  w->done = 1;
+  pthread_cond_signal (&w->cond);
+  pthread_mutex_unlock (&w->mutex);
+
+  return NULL;
+}
+
+
+static void *
+posixlock_watchdog (arg)
+     void *arg;
+{
+  struct posixlock_wait *w = (struct posixlock_wait *) arg;
+  struct timespec retry;
+  struct timeval now;
+
+  pthread_mutex_lock (&w->mutex);
+  while (!w->done)
+    {
+      if (!w->timed_out)
+	{
+	  if (pthread_cond_timedwait (&w->cond, &w->mutex, &w->deadline) !=
+	      ETIMEDOUT)
+	    continue;
+	  w->timed_out = 1;
+	}
+      /* the waiter may not have reached fcntl yet, so keep at it */
+      pthread_kill (w->waiter, SIGVTALRM);
+      gettimeofday (&now, NULL);
+      retry.tv_sec = now.tv_sec;
+      retry.tv_nsec = now.tv_usec * 1000 + 10000000;
+      if (retry.tv_nsec >= 1000000000)
+	{
+	  retry.tv_sec++;
+	  retry.tv_nsec -= 1000000000;
+	}
+      pthread_cond_timedwait (&w->cond, &w->mutex, &retry);
+    }
+  pthread_mutex_unlock (&w->mutex);
+
+  return NULL;
+}
+
+
+/* whether the interpreter handles SIGVTALRM; without a handler the signal
+ * would kill the process, not interrupt fcntl */
+static int
+posixlock_can_interrupt ()
+{
+  struct sigaction sa;
+
+  if (sigaction (SIGVTALRM, NULL, &sa) != 0)
+    return 0;
+  if (sa.sa_flags & SA_SIGINFO)
+    return 1;
+  return sa.sa_handler != SIG_DFL && sa.sa_handler != SIG_IGN;
+}
+
+
+/* stops the watchdog, if one is running */
+static void
+posixlock_unwatch (w, watchdog, watching)
+     struct posixlock_wait *w;
+     pthread_t watchdog;
+     int *watching;
+{
+  if (*watching)
+    {
+      pthread_mutex_lock (&w->mutex);
+      w->done = 1;
+      pthread_cond_signal (&w->cond);
+      pthread_mutex_unlock (&w->mutex);
+      pthread_join (watchdog, NULL);
+      *watching = 0;
+    }
+}
+
+
+/* returns 0 when locked, -1 with errno set otherwise (EAGAIN on timeout),
+ * or -2 if the caller should poll instead */
+static int
+posixlock_wait (fd, operation, seconds)
+     int fd;
+     int operation;
+     double seconds;
+{
+  struct posixlock_wait w;
+  struct timeval now;
+  pthread_t watchdog;
+  int watching = 0;
+  int skipped = 0;
+  double at;
+
+  memset (&w, 0, sizeof (w));
+  w.fd = fd;
+  w.operation = operation;
+  w.waiter = pthread_self ();
+  pthread_mutex_init (&w.mutex, NULL);
+  pthread_cond_init (&w.cond, NULL);
+
+  if (seconds >= 0)
+    {
+      gettimeofday (&now, NULL);
+      at = now.tv_sec + now.tv_usec / 1e6 + seconds;
+      w.deadline.tv_sec = (time_t) at;
+      w.deadline.tv_nsec = (long) ((at - (double) w.deadline.tv_sec) * 1e9);
+    }
+
+  for (;;)
+    {
+      w.ret = -1;
+      w.err = EINTR;
+      w.done = 0;
+      w.entered = 0;
+      if (seconds >= 0)
+	{
+	  watching = (pthread_create (&watchdog, NULL, posixlock_watchdog, &w) == 0);
+	  if (!watching)
+	    {
+	      w.ret = -2;
+	      break;
+	    }
+	}
+
+      rb_thread_call_without_gvl2 (posixlock_blocking, &w, RUBY_UBF_IO, NULL);
+      posixlock_unwatch (&w, watchdog, &watching);
+
+      if (w.ret == 0 || w.err != EINTR || w.timed_out)
+	break;
+
+      /* an interrupt that stays pending (masked by Thread.handle_interrupt,
+       * say) keeps us out of fcntl altogether */
+      if (!w.entered && ++skipped > 1)
+	{
+	  w.ret = -2;
+	  break;
+	}
+
+      /* woken for the interpreter: let it raise if it means to, while no
+       * lock is held, then go back to waiting */
+      rb_thread_check_ints ();
+
+      if (seconds >= 0)
+	{
+	  gettimeofday (&now, NULL);
+	  if (now.tv_sec > w.deadline.tv_sec ||
+	      (now.tv_sec == w.deadline.tv_sec &&
+	       now.tv_usec * 1000 >= w.deadline.tv_nsec))
+	    {
+	      w.timed_out = 1;
+	      break;
+	    }
+	}
+    }
+
+  pthread_cond_destroy (&w.cond);
+  pthread_mutex_destroy (&w.mutex);
+
+  if (w.ret == 0 || w.ret == -2)
+    return w.ret;
+  errno = (w.timed_out && w.err == EINTR) ? EAGAIN : w.err;
+  return -1;
+}
+#endif
+
+
+/* process wide tallies of the waiting done by posixlock_timeout, read with
+ * File.posixlock_counts: lock calls made, calls refused because the lock was
+ * held, waits that ran out, and the holder last seen refusing us.  updated
+ * only with the interpreter lock held */
+static unsigned long posixlock_attempts;
+static unsigned long posixlock_refusals;
+static unsigned long posixlock_timeouts;
+static int posixlock_last_holder;
+
+
+/* the fallback: poll with exponential backoff, sleeping in the interpreter */
+static int
+posixlock_poll (fd, operation, seconds)
+     int fd;
+     int operation;
+     double seconds;
+{
+  struct timeval start, now, nap;
+  double elapsed, wait = 0.001;
+  int ret;
+
+  gettimeofday (&start, NULL);
+  for (;;)
+    {
+      posixlock_attempts++;
+      ret = posixlock (fd, operation | LOCK_NB);
+      if (ret == 0)
+	return 0;
+      posixlock_refusals++;
+      if (errno != EAGAIN && errno != EACCES && errno != EINTR
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+	  && errno != EWOULDBLOCK
+#endif
+	)
+	return -1;
+
+      gettimeofday (&now, NULL);
+      elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6;
+      if (seconds >= 0 && elapsed >= seconds)
+	{
+	  errno = EAGAIN;
+	  return -1;
+	}
+      if (seconds >= 0 && wait > seconds - elapsed)
+	wait = seconds - elapsed;
+      nap.tv_sec = (long) wait;
+      nap.tv_usec = (long) ((wait - nap.tv_sec) * 1e6);
+      rb_thread_wait_for (nap);
+      if (wait < 0.1)
+	wait *= 2;
+    }
+}
+
+
+/*
+ * call-seq:
+ *    file.posixlock_timeout(operation, seconds)  => 0 or false
+ *
+ * Like posixlock, but waits up to +seconds+ for the lock (forever if
+ * +seconds+ is nil), returning false if it still isn't granted.  Other
+ * threads run meanwhile, and an interrupt (Thread#raise, kill, a signal
+ * trap that raises) ends the wait at once.  LOCK_NB in +operation+ is
+ * ignored.
+ */
+static VALUE
+rb_file_posixlock_timeout (obj, operation, seconds)
+     VALUE obj;
+     VALUE operation;
+     VALUE seconds;
+{
+#ifndef __CHECKER__
+  rb_io_t *fptr = NULL;
+  int ret;
+  int fd;
+  int op;
+  double secs;
+
+  rb_secure (2);
+  GetOpenFile(obj, fptr);
+  assert(fptr);
+
+  op = NUM2INT (operation) & ~LOCK_NB;
+  secs = NIL_P (seconds) ? -1.0 : NUM2DBL (seconds);
+  if (!NIL_P (seconds) && secs < 0)
+    secs = 0;
+
+  if (fptr->mode & FMODE_WRITABLE)
+    {
+      fflush ((FILE *)GetWriteFile (fptr));
+    }
+  fd = fptr->fd;
+
+  /* unlocking, and an uncontended lock, never wait */
+  posixlock_attempts++;
+  ret = posixlock (fd, op | LOCK_NB);
+  if (ret < 0 && (op & ~LOCK_MODES) != LOCK_UN &&
+      (errno == EAGAIN || errno == EACCES || errno == EINTR
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+       || errno == EWOULDBLOCK
+#endif
+      ))
+    {
+      int holder = 0;
+
+      posixlock_refusals++;
+      /* only the slow path pays for asking who is in the way */
+      if (posixlock_holder (fd, op, &holder) == 0 && holder != 0)
+	posixlock_last_holder = holder;
+      errno = EAGAIN;
+    }
+  if (ret < 0 && errno == EAGAIN && (op & ~LOCK_MODES) != LOCK_UN && secs != 0)
+    {
+      ret = -2;
+#ifdef POSIXLOCK_RELEASE_GVL
+      if (posixlock_can_interrupt ())
+	{
+	  ret = posixlock_wait (fd, op, secs);
+	  if (ret != -2)
+	    {
+	      posixlock_attempts++;
+	      if (ret < 0)
+		posixlock_refusals++;
+	    }
+	}
+#endif
+      if (ret == -2)
+	ret = posixlock_poll (fd, op, secs);
+      if (ret < 0 && errno == EAGAIN)
+	posixlock_timeouts++;
+    }
+  if (ret < 0)
+    {
+      switch (errno)
+	{
+	case EAGAIN:
+	case EACCES:
+	case EINTR:
+#if defined(EWOULDBLOCK) && EWOULDBLOCK != EAGAIN
+	case EWOULDBLOCK:
+#endif
+	  return Qfalse;
+	}
+      rb_sys_fail ((const char *)(STR2CSTR(fptr->pathv)));
+    }
+#endif
+
+  return INT2FIX (0);
+}
+
+
+/*
+ * call-seq:
+ *    File.posixlock_counts  => [attempts, refusals, timeouts, holder]
+ *
+ * Running totals for every File#posixlock_timeout in this process: the lock
+ * calls made, those refused because another held the lock, the waits that
+ * timed out, and the pid (-1 for an open file description lock, nil if none
+ * yet) last found holding a lock we had to wait for.
+ */
+static VALUE
+rb_file_s_posixlock_counts (klass)
+     VALUE klass;
+{
+  return rb_ary_new3 (4,
+		      ULONG2NUM (posixlock_attempts),
+		      ULONG2NUM (posixlock_refusals),
+		      ULONG2NUM (posixlock_timeouts),
+		      posixlock_last_holder == 0 ? Qnil : INT2FIX (posixlock_last_holder));
+}
+
+
+/*
+ * call-seq:
+ *    file.posixlock_holder(operation)  => pid, -1 or nil
+ *
+ * Tests, with F_GETLK (F_OFD_GETLK given LOCK_OFD), whether the lock
+ * +operation+ asks for could be taken.  Returns nil if so, otherwise the pid
+ * of a process holding a conflicting lock, or -1 when that is an open file
+ * description lock.  flock locks are not seen.
+ */
+static VALUE
+rb_file_posixlock_holder (obj, operation)
+     VALUE obj;
+     VALUE operation;
+{
+  rb_io_t *fptr = NULL;
+  int holder = 0;
+
+  rb_secure (2);
+  GetOpenFile(obj, fptr);
+  assert(fptr);
+
+  if (posixlock_holder (fptr->fd, NUM2INT (operation), &holder) < 0)
+    rb_sys_fail ((const char *)(STR2CSTR(fptr->pathv)));
+
+  return holder == 0 ? Qnil : INT2FIX (holder);
+}
+
+
+/*
+ * File::Lease keeps a lockfile fresh by touching it at an interval, so that
+ * other processes don't take it for stale while the lock is held.  The
+ * touching is done by a native thread which holds no interpreter lock and
+ * blocks every signal: it goes on however long the interpreter itself is
+ * stuck in fcntl, and it starts and stops in microseconds, where forking a
+ * refresher process per transaction takes milliseconds.  Being a thread it
+ * also dies with the process, as a refresher must.
+ */
+#ifdef POSIXLOCK_LEASE
+struct posixlock_lease
+{
+  char *path;
+  double interval;
+  pid_t owner;                  /* the thread doesn't survive a fork */
+  int stopping;
+  int running;
+  int refs;                     /* the ruby object and the thread */
+  pthread_t keeper;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+
+/* utimes the file to now, creating it if it has gone, like FileUtils.touch */
+static int
+posixlock_touch (path)
+     const char *path;
+{
+  int fd;
+
+  if (utimes (path, NULL) == 0)
+    return 0;
+  if (errno != ENOENT)
+    return -1;
+  fd = open (path, O_WRONLY | O_CREAT, 0666);
+  if (fd < 0)
+    return -1;
+  close (fd);
+  return 0;
+}
+
+
+/* drops one reference, freeing the lease with the last; called locked */
+static void
+posixlock_lease_unref (l)
+     struct posixlock_lease *l;
+{
+  int last = --l->refs == 0;
+
+  pthread_mutex_unlock (&l->mutex);
+  if (last)
+    {
+      pthread_cond_destroy (&l->cond);
+      pthread_mutex_destroy (&l->mutex);
+      free (l->path);
+      free (l);
+    }
+}
+
+
+static void *
+posixlock_lease_keeper (arg)
+     void *arg;
+{
+  struct posixlock_lease *l = (struct posixlock_lease *) arg;
+  struct timespec deadline;
+  struct timeval now;
+  double at;
+
+  pthread_mutex_lock (&l->mutex);
+  while (!l->stopping)
+    {
+      gettimeofday (&now, NULL);
+      at = now.tv_sec + now.tv_usec / 1e6 + l->interval;
+      deadline.tv_sec = (time_t) at;
+      deadline.tv_nsec = (long) ((at - deadline.tv_sec) * 1e9);
+      while (!l->stopping &&
+	     pthread_cond_timedwait (&l->cond, &l->mutex, &deadline) != ETIMEDOUT)
+	;
+      if (l->stopping)
+	break;
+      /* a touch stuck on a dead nfs server mustn't hold up stop */
+      pthread_mutex_unlock (&l->mutex);
+      posixlock_touch (l->path);
+      pthread_mutex_lock (&l->mutex);
+    }
+  l->running = 0;
+  posixlock_lease_unref (l);
+
+  return NULL;
+}
+
+
+/* tells the keeper to stop without waiting for it; false if it had been */
+static int
+posixlock_lease_stop (l)
+     struct posixlock_lease *l;
+{
+  int was;
+
+  pthread_mutex_lock (&l->mutex);
+  was = !l->stopping;
+  l->stopping = 1;
+  pthread_cond_signal (&l->cond);
+  pthread_mutex_unlock (&l->mutex);
+
+  return was;
+}
+
+
+static void
+posixlock_lease_free (arg)
+     void *arg;
+{
+  struct posixlock_lease *l = (struct posixlock_lease *) arg;
+
+  /* in a forked child the mutex may be copied held by a keeper which
+   * isn't there to release it: leave the copy be */
+  if (l->owner != getpid ())
+    return;
+  posixlock_lease_stop (l);
+  pthread_mutex_lock (&l->mutex);
+  posixlock_lease_unref (l);
+}
+
+
+static struct posixlock_lease *
+posixlock_lease_get (obj)
+     VALUE obj;
+{
+  struct posixlock_lease *l = NULL;
+
+  Data_Get_Struct (obj, struct posixlock_lease, l);
+  assert (l);
+  return l;
+}
+
+
+/*
+ * call-seq:
+ *    File::Lease.new(path, seconds)  => lease
+ *
+ * Touches +path+ now and then every +seconds+ from a native thread until
+ * the lease is stopped (or collected).
+ */
+static VALUE
+rb_file_lease_new (klass, path, seconds)
+     VALUE klass;
+     VALUE path;
+     VALUE seconds;
+{
+  struct posixlock_lease *l;
+  sigset_t all, saved;
+  double interval;
+  char *cpath;
+  int err;
+
+  rb_secure (2);
+  SafeStringValue (path);
+  interval = NUM2DBL (seconds);
+  if (interval <= 0)
+    rb_raise (rb_eArgError, "refresh rate must be positive");
+
+  cpath = StringValueCStr (path);
+  if (posixlock_touch (cpath) < 0)
+    rb_sys_fail (cpath);
+
+  /* plain malloc: the keeper frees the lease if it outlives the object */
+  l = (struct posixlock_lease *) malloc (sizeof (*l));
+  if (l == NULL || (l->path = strdup (cpath)) == NULL)
+    {
+      free (l);
+      rb_memerror ();
+    }
+  l->interval = interval;
+  l->owner = getpid ();
+  l->stopping = 0;
+  l->running = 1;
+  l->refs = 2;
+  pthread_mutex_init (&l->mutex, NULL);
+  pthread_cond_init (&l->cond, NULL);
+
+  /* the keeper inherits the mask, leaving every signal to the interpreter */
+  sigfillset (&all);
+  pthread_sigmask (SIG_SETMASK, &all, &saved);
+  err = pthread_create (&l->keeper, NULL, posixlock_lease_keeper, l);
+  pthread_sigmask (SIG_SETMASK, &saved, NULL);
+  if (err != 0)
+    {
+      pthread_cond_destroy (&l->cond);
+      pthread_mutex_destroy (&l->mutex);
+      free (l->path);
+      free (l);
+      errno = err;
+      rb_sys_fail ("pthread_create");
+    }
+  pthread_detach (l->keeper);
+
+  return Data_Wrap_Struct (klass, NULL, posixlock_lease_free, l);
+}
+
+
+/*
+ * call-seq:
+ *    lease.stop  => true or false
+ *
+ * Stops refreshing, returning at once; false if already stopped.
+ */
+static VALUE
+rb_file_lease_stop (obj)
+     VALUE obj;
+{
+  struct posixlock_lease *l = posixlock_lease_get (obj);
+
+  if (l->owner != getpid ())
+    return Qfalse;
+  return posixlock_lease_stop (l) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    lease.alive?  => true or false
+ *
+ * Whether the keeper thread is still running.
+ */
+static VALUE
+rb_file_lease_alive_p (obj)
+     VALUE obj;
+{
+  struct posixlock_lease *l = posixlock_lease_get (obj);
+  int running;
+
+  if (l->owner != getpid ())
+    return Qfalse;
+  pthread_mutex_lock (&l->mutex);
+  running = l->running;
+  pthread_mutex_unlock (&l->mutex);
+
+  return running ? Qtrue : Qfalse;
+}
+#endif
+
+
 static VALUE
 rb_file_lockf (obj, cmd, len)
      VALUE obj;
@@ -296,4 +1054,17 @@ Init_posixlock ()
   rb_define_const (rb_cFile, "F_TESTW", rb_cFile_F_TESTW);
   rb_define_method (rb_cFile, "lockf", rb_file_lockf, 2);
   rb_define_method (rb_cFile, "posixlock", rb_file_posixlock, 1);
+  rb_define_method (rb_cFile, "posixlock_timeout", rb_file_posixlock_timeout, 2);
+  rb_define_method (rb_cFile, "posixlock_holder", rb_file_posixlock_holder, 1);
+  rb_define_singleton_method (rb_cFile, "posixlock_counts", rb_file_s_posixlock_counts, 0);
+  rb_define_const (rb_cFile, "LOCK_OFD", INT2FIX (LOCK_OFD));
+  rb_define_const (rb_cFile, "LOCK_FLOCK", INT2FIX (LOCK_FLOCK));
+  rb_define_const (rb_cFile, "LOCK_INTENT", INT2FIX (LOCK_INTENT));
+#ifdef POSIXLOCK_LEASE
+  rb_cFile_Lease = rb_define_class_under (rb_cFile, "Lease", rb_cObject);
+  rb_undef_alloc_func (rb_cFile_Lease);
+  rb_define_singleton_method (rb_cFile_Lease, "new", rb_file_lease_new, 2);
+  rb_define_method (rb_cFile_Lease, "stop", rb_file_lease_stop, 0);
+  rb_define_method (rb_cFile_Lease, "alive?", rb_file_lease_alive_p, 0);
+#endif
 }
@@ -30,9 +30,27 @@
 #include <sqlite.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/time.h>
 #include "ruby.h"
 #include "stdarg.h"
 
+/* when the interpreter provides the means, the engine runs with the global
+ * interpreter lock released (see static_run_engine), taking it back only to
+ * hand rows and custom function calls to ruby. */
+
+#if defined( HAVE_RUBY_THREAD_H ) && defined( HAVE_RB_THREAD_CALL_WITHOUT_GVL2 ) && defined( HAVE_RB_THREAD_CALL_WITH_GVL )
+#include "ruby/thread.h"
+#define SQLITE_RUBY_RELEASE_GVL 1
+#endif
+
 /* these constants defines the current version of the SQLite/Ruby module */
 
 #define LIB_VERSION_MAJOR  1
@@ -45,12 +63,80 @@
  * handle.  This way, if the 'db' member is NULL, we know the database is
  * not open. */
 
+struct SQLITE_RUBY_STATEMENT;
+
+/* The statement profiler.  While profiling is on (SQLite.profiling=), every
+ * statement run through the binding is timed and its time, in microseconds,
+ * is added to the totals for its shape: the SQL with literals replaced by '?'
+ * and whitespace collapsed.  Each shape keeps a histogram with four buckets
+ * per power of two of microseconds, from which SQLite.profile derives
+ * percentiles.  The totals are process wide, and updated without the
+ * interpreter lock, so they are guarded by a mutex of their own. */
+
+#define SQLITE_RUBY_PROFILE_BUCKETS 128
+#define SQLITE_RUBY_SHAPE_MAX       512
+
+typedef struct SQLITE_RUBY_SHAPE
+{
+  char *shape;
+  unsigned long count;      /* times a statement of this shape was run */
+  unsigned long rows;       /* rows those runs produced */
+  double usecs;             /* the total time they took */
+  unsigned long buckets[SQLITE_RUBY_PROFILE_BUCKETS];
+  struct SQLITE_RUBY_SHAPE *next;
+} SQLITE_RUBY_SHAPE;
+
+/* the statement #exec is running, as last reported by sqlite_trace, which
+ * the engine calls as it compiles each statement of the SQL text */
+
+typedef struct
+{
+  char *shape;              /* the shape of the statement, or NULL before the first */
+  struct timeval start;     /* when it was compiled */
+  unsigned long rows;       /* the rows it has produced so far */
+} SQLITE_RUBY_TRACE;
+
+/* the policy of the native busy handler installed by #busy_backoff: waits
+ * start at 'first' microseconds and double up to 'max', each one jittered
+ * down by as much as half, until 'timeout' microseconds have passed since
+ * the engine call that hit the lock began waiting. */
+
+typedef struct
+{
+  long first;
+  long max;
+  long timeout;
+  long attempts;            /* the waits made in the current engine call */
+  struct timeval start;     /* when the first of them began */
+  unsigned int seed;        /* rand_r state for the jitter */
+  volatile int interrupted; /* set when the interpreter interrupts the engine */
+} SQLITE_RUBY_BUSY;
+
 typedef struct
 {
   sqlite *db;
   int     use_array;
+  struct SQLITE_RUBY_STATEMENT *statements; /* every statement compiled on this handle */
+  VALUE   owner;          /* the thread running the engine on this handle, or Qnil */
+  int     unlocked;       /* whether the engine is running without the interpreter lock */
+  int     pending;        /* the tag of an exception raised by a callback, to be rethrown */
+  SQLITE_RUBY_BUSY busy;  /* the busy handler policy and the state of its current wait */
+  SQLITE_RUBY_TRACE *trace; /* the statement being profiled by #exec, or NULL */
+  unsigned long commits;  /* the transactions the engine has committed on this handle */
+  VALUE   decoders;       /* the column decoders set by #column_decoders=, or Qnil */
 } SQLITE_RUBY_DATA;
 
+/* The native decoders a result column can be given (see #column_decoders=). */
+
+#define SQLITE_RUBY_DECODE_NONE    0
+#define SQLITE_RUBY_DECODE_INTEGER 1
+#define SQLITE_RUBY_DECODE_FLOAT   2
+#define SQLITE_RUBY_DECODE_TIME    3
+#define SQLITE_RUBY_DECODE_INTERN  4
+
+/* the most distinct values an interned column shares before it stops trying */
+#define SQLITE_RUBY_INTERN_MAX     64
+
 
 /* This represents the information for a callback during query execution. */
 
@@ -60,11 +146,39 @@ typedef struct
   VALUE arg;              /* the application-defined cookie value to pass to the method */
   VALUE columns;          /* a ruby array of all of the column names */
   VALUE types;            /* a ruby hash of all of the column types (may be null) */
+  VALUE fieldset;         /* the SQLite::Row::FieldSet shared by every row (see static_build_fieldset) */
   int   built_columns;    /* whether or not the 'columns' member is valid yet */
   int   do_translate;     /* whether or not to do type translation */
+  VALUE schema;           /* the column decoders 'decoders' was built from */
+  VALUE decoders;         /* one SQLITE_RUBY_DECODE_* byte per column, or Qnil */
+  VALUE interned;         /* per column, the frozen strings shared so far, or Qnil */
+  char  stamp_hour[ 14 ]; /* the 'YYYY-MM-DD HH' of the last timestamp decoded... */
+  time_t stamp_base;      /* ...and the local time it began at */
   SQLITE_RUBY_DATA *self; /* a reference to the database instance being queried */
 } SQLITE_RUBY_CALLBACK;
 
+/* This wraps a virtual machine compiled by sqlite_compile.  Statements are
+ * kept on a list in their database handle, because sqlite_close does not
+ * finalize outstanding virtual machines and finalizing one after its
+ * database is gone is fatal.  When the database is closed first, every
+ * statement on the list is finalized and detached (hook.self is NULL). */
+
+typedef struct SQLITE_RUBY_STATEMENT
+{
+  sqlite_vm *vm;            /* the compiled statement, or NULL once finalized */
+  VALUE sql;                /* the text the statement was compiled from */
+  VALUE binds;              /* the values bound so far, replayed after a schema change */
+  int   active;             /* whether sqlite_step has been called since the last reset */
+  int   done;               /* whether sqlite_step has returned SQLITE_DONE */
+  char *shape;              /* the statement's profiling shape, made when first needed */
+  double usecs;             /* time spent stepping since the last reset, when profiling */
+  unsigned long rows;       /* rows produced since the last reset, when profiling */
+  int   timed;              /* whether usecs and rows are waiting to be recorded */
+  SQLITE_RUBY_CALLBACK hook; /* column names and types of the result set */
+  struct SQLITE_RUBY_STATEMENT *prev;
+  struct SQLITE_RUBY_STATEMENT *next;
+} SQLITE_RUBY_STATEMENT;
+
 /* This represents the information for a callback on a custom SQL function */
 
 typedef struct
@@ -72,23 +186,67 @@ typedef struct
   VALUE callback;        /* the Method object to invoke for each function invocation */
   VALUE finalize;        /* the Method object to invoke when an aggregate function is finished */
   VALUE arg;             /* the app-defined cookie value */
+  SQLITE_RUBY_DATA *hdb; /* the database the function was registered with */
 } SQLITE_CUSTOM_FUNCTION_CB;
 
+/* The arguments of a callback from the engine, passed through to the body
+ * that runs it under the interpreter lock (see static_call_ruby). */
+
+typedef struct
+{
+  SQLITE_RUBY_CALLBACK *hook; /* the query being processed, for row callbacks */
+  sqlite_func *ctx;           /* the function context, for custom function callbacks */
+  int    argc;
+  char **argv;
+  char **columns;
+} SQLITE_RUBY_CALLBACK_ARGS;
+
+/* A call into the engine, made by static_run_engine on behalf of
+ * #exec (sql, callback, arg, err) or Statement#step (vm, values, columns). */
+
+typedef struct
+{
+  SQLITE_RUBY_DATA *hdb;
+  const char  *sql;
+  sqlite_callback callback;
+  void        *arg;
+  char       **err;
+  sqlite_vm   *vm;
+  int          argc;
+  const char **values;
+  const char **columns;
+  int          rc;
+} SQLITE_RUBY_ENGINE_CALL;
+
 
 /* global variables for defining the classes, modules, and symbols that are used by this
  * module. */
 
 static VALUE mSQLite;
 static VALUE cSQLite;
+static VALUE cSQLiteStatement;
+static VALUE cSQLiteRow;
+static VALUE cSQLiteHashRow;
+static VALUE cSQLiteFieldSet;
 static VALUE cSQLiteTypeTranslator;
 static VALUE cSQLiteException;
 static VALUE cSQLiteQueryContext;
 static VALUE oSQLiteQueryAbort;
 static ID    idCallMethod;
-static ID    idInstanceEvalMethod;
 static ID    idTranslate;
-static ID    idFields;
-static ID    idFieldsEqual;
+static ID    idIvFieldset;
+static ID    idIvFields;
+static ID    idIvFieldpos;
+static ID    idIvArgument;
+static ID    idIvColumnTypes;
+static ID    idInteger;
+static ID    idFloat;
+static ID    idTime;
+static ID    idIntern;
+
+static int               g_profiling = 0;
+static SQLITE_RUBY_SHAPE *g_profile = NULL;
+static pthread_mutex_t   g_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static struct {
   const char *name;
@@ -118,6 +276,9 @@ static struct {
   { "Misuse", 0 },
   { "UnsupportedOSFeature", 0 },
   { "Authorization", 0 },
+  { "Format", 0 },
+  { "Range", 0 },
+  { "NotADatabase", 0 },
   { NULL, 0 }
 };
 
@@ -128,6 +289,57 @@ static void static_free_database_handle( SQLITE_RUBY_DATA *hdb );
 /* called when a query is processing another row */
 static int static_ruby_sqlite_callback( void *pArg, int argc, char **argv, char **columns );
 
+/* runs a call into the engine, with the interpreter lock released if possible */
+static void static_run_engine( SQLITE_RUBY_DATA *hdb, void *(*func)( void * ), SQLITE_RUBY_ENGINE_CALL *call );
+
+/* runs a ruby callback for the engine, under the interpreter lock */
+static VALUE static_call_ruby( SQLITE_RUBY_DATA *hdb, VALUE (*func)( VALUE ), SQLITE_RUBY_CALLBACK_ARGS *args );
+
+/* rethrows an exception raised by a callback while the engine was running */
+static void static_raise_pending( SQLITE_RUBY_DATA *hdb );
+
+/* raises if another thread is running the engine on the given handle */
+static void static_check_owner( SQLITE_RUBY_DATA *hdb );
+
+/* called by the engine when a table it needs is locked */
+static int static_busy_handler( void *pHdb, const char *table, int count );
+
+/* called by the engine as each transaction on the handle commits */
+static int static_commit_hook( void *pHdb );
+
+/* starts the busy handler's deadline afresh for a new call into the engine */
+static void static_busy_reset( SQLITE_RUBY_DATA *hdb );
+
+/* compiles the first SQL statement in the given text, raising on failure */
+static sqlite_vm *static_compile_vm( sqlite *db, const char *sql );
+
+/* returns the profiling shape of the given SQL, in memory from malloc */
+static char *static_sql_shape( const char *sql );
+
+/* adds one run of a statement to the profile */
+static void static_profile_record( const char *shape, double usecs, unsigned long rows );
+
+/* called by the engine with the text of each statement it compiles */
+static void static_trace_callback( void *pHdb, const char *sql );
+
+/* records the statement #exec was running, if any, as finished at 'now' */
+static void static_trace_finish( SQLITE_RUBY_TRACE *trace, struct timeval *now );
+
+/* records the time a statement has spent stepping since its last reset */
+static void static_statement_record( struct SQLITE_RUBY_STATEMENT *stmt );
+
+/* builds the column table shared by all rows of a result set */
+static void static_build_fieldset( SQLITE_RUBY_CALLBACK *hook, int argc, char **columns );
+
+/* works out which native decoder, if any, applies to each result column */
+static void static_build_decoders( SQLITE_RUBY_CALLBACK *hook, int argc, char **columns );
+
+/* decodes a cell with a native decoder, or returns Qundef if it doesn't parse */
+static VALUE static_decode_value( SQLITE_RUBY_CALLBACK *hook, int how, int column, const char *value );
+
+/* builds the ruby representation of a single result row */
+static VALUE static_build_row( SQLITE_RUBY_CALLBACK *hook, int argc, char **argv, char **columns );
+
 /* called when a custom SQL function is invoked */
 static void static_custom_function_callback( sqlite_func* ctx, int argc, const char **argv );
 
@@ -144,7 +356,7 @@ static int static_pragma_enabled( sqlite* db, const char *pragma );
 static void static_configure_exception_classes();
 
 /* raise an exception */
-static void static_raise_db_error( int code, const char *msg, ... );
+NORETURN( static void static_raise_db_error( int code, const char *msg, ... ) );
 
 
 static VALUE static_database_new( VALUE klass,
@@ -158,10 +370,38 @@ static VALUE static_database_exec( VALUE self,
                                    VALUE callback,
                                    VALUE parm );
 
+static VALUE static_insert_many( VALUE self,
+                                 VALUE table,
+                                 VALUE columns,
+                                 VALUE rows );
+
+static VALUE static_set_profiling( VALUE self,
+                                   VALUE on );
+
+static VALUE static_is_profiling( VALUE self );
+
+static VALUE static_profile_data( VALUE self );
+
+static VALUE static_reset_profile( VALUE self );
+
+static VALUE static_set_busy_timeout( VALUE self,
+                                      VALUE ms );
+
+static VALUE static_busy_backoff( int argc,
+                                  VALUE *argv,
+                                  VALUE self );
+
 static VALUE static_last_insert_rowid( VALUE self );
 
 static VALUE static_changes( VALUE self );
 
+static VALUE static_commits( VALUE self );
+
+static VALUE static_set_column_decoders( VALUE self,
+                                         VALUE decoders );
+
+static VALUE static_column_decoders( VALUE self );
+
 static VALUE static_interrupt( VALUE self );
 
 static VALUE static_complete( VALUE self,
@@ -188,11 +428,60 @@ static VALUE static_is_doing_type_translation( VALUE self );
 
 static VALUE static_set_type_translation( VALUE self, VALUE value );
 
+static VALUE static_database_compile( VALUE self,
+                                      VALUE sql );
+
+static VALUE static_statement_bind( VALUE self,
+                                    VALUE index,
+                                    VALUE value );
+
+static VALUE static_statement_step( VALUE self );
+
+static VALUE static_statement_step_batch( VALUE self,
+                                          VALUE size );
+
+static VALUE static_statement_reset( VALUE self );
+
+static VALUE static_statement_finalize( VALUE self );
+
+static VALUE static_statement_is_closed( VALUE self );
+
+static VALUE static_statement_sql( VALUE self );
+
+static VALUE static_statement_columns( VALUE self );
+
+
+/* finalizes every statement compiled on the handle and detaches them from it,
+ * which must happen before the handle is closed. */
+static void static_finalize_statements( SQLITE_RUBY_DATA *hdb )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+  SQLITE_RUBY_STATEMENT *next;
+
+  for( stmt = hdb->statements; stmt != NULL; stmt = next )
+  {
+    next = stmt->next;
+
+    if( stmt->vm != NULL )
+    {
+      sqlite_finalize( stmt->vm, NULL );
+      stmt->vm = NULL;
+    }
+
+    stmt->hook.self = NULL;
+    stmt->prev = stmt->next = NULL;
+  }
+
+  hdb->statements = NULL;
+}
+
 
 static void static_free_database_handle( SQLITE_RUBY_DATA *hdb )
 {
   if( hdb )
   {
+    static_finalize_statements( hdb );
+
     if( hdb->db )
     {
       sqlite_close( hdb->db );
@@ -204,230 +493,977 @@ static void static_free_database_handle( SQLITE_RUBY_DATA *hdb )
 }
 
 
-static int static_ruby_sqlite_callback( void *pArg, int argc, char **argv, char **columns )
+static void static_mark_statement( SQLITE_RUBY_STATEMENT *stmt )
 {
-  SQLITE_RUBY_CALLBACK *hook = (SQLITE_RUBY_CALLBACK*)pArg;
-  VALUE result;
-  int i;
-  VALUE rc;
+  rb_gc_mark( stmt->sql );
+  rb_gc_mark( stmt->binds );
+  rb_gc_mark( stmt->hook.columns );
+  rb_gc_mark( stmt->hook.types );
+  rb_gc_mark( stmt->hook.fieldset );
+  rb_gc_mark( stmt->hook.schema );
+  rb_gc_mark( stmt->hook.decoders );
+  rb_gc_mark( stmt->hook.interned );
+}
 
-  if( hook->self->use_array )
-  {
-    result = rb_ary_new();
-  }
+
+/* unlinks the statement from its database (if that is still open) */
+static void static_unlink_statement( SQLITE_RUBY_STATEMENT *stmt )
+{
+  if( stmt->hook.self == NULL )
+    return;
+
+  if( stmt->prev != NULL )
+    stmt->prev->next = stmt->next;
   else
+    stmt->hook.self->statements = stmt->next;
+
+  if( stmt->next != NULL )
+    stmt->next->prev = stmt->prev;
+
+  stmt->prev = stmt->next = NULL;
+}
+
+
+static void static_free_statement( SQLITE_RUBY_STATEMENT *stmt )
+{
+  if( stmt )
   {
-    result = rb_hash_new();
+    if( stmt->vm != NULL )
+    {
+      sqlite_finalize( stmt->vm, NULL );
+      stmt->vm = NULL;
+    }
+
+    static_unlink_statement( stmt );
+
+    if( stmt->shape ) free( stmt->shape );
+    free( stmt );
   }
+}
 
-  if( !hook->built_columns )
+
+/* builds the column table shared by every row of a result set: the column
+ * names, a name to index map, the column types (if show_datatypes is on) and
+ * the callback argument.  all of it is frozen; a row that is given a new
+ * field copies the table first (see static_row_aset). */
+static void static_build_fieldset( SQLITE_RUBY_CALLBACK *hook, int argc, char **columns )
+{
+  VALUE fieldpos;
+  VALUE fieldset;
+  int i;
+
+  hook->columns = rb_ary_new2( argc );
+  fieldpos = rb_hash_new();
+
+  for( i = 0; i < argc; i++ )
   {
-    hook->columns = rb_ary_new2( argc );
+    VALUE name = rb_obj_freeze( rb_str_new2( columns[i] ) );
+
+    rb_ary_push( hook->columns, name );
+    rb_hash_aset( fieldpos, name, INT2FIX(i) );
+
+    if( hook->types != Qnil )
+    {
+      VALUE type;
+      char *type_name = columns[ i + argc ];
+
+      type = rb_str_new2( type_name == NULL ? "STRING" : type_name );
+      rb_hash_aset( hook->types, name, type );
+      rb_hash_aset( hook->types, INT2FIX(i), type );
+    }
   }
 
+  rb_obj_freeze( hook->columns );
+  rb_obj_freeze( fieldpos );
+
+  fieldset = rb_obj_alloc( cSQLiteFieldSet );
+  rb_ivar_set( fieldset, idIvFields, hook->columns );
+  rb_ivar_set( fieldset, idIvFieldpos, fieldpos );
+  rb_ivar_set( fieldset, idIvArgument, hook->arg );
+  rb_ivar_set( fieldset, idIvColumnTypes, hook->types );
+
+  hook->fieldset = fieldset;
+  hook->built_columns = 1;
+}
+
+
+static void static_build_decoders( SQLITE_RUBY_CALLBACK *hook, int argc, char **columns )
+{
+  VALUE schema = hook->self->decoders;
+  VALUE decoders;
+  char *codes;
+  int used = 0;
+  int i;
+
+  hook->schema = schema;
+  hook->decoders = Qnil;
+  hook->interned = Qnil;
+
+  if( NIL_P( schema ) )
+    return;
+
+  decoders = rb_str_new( NULL, argc );
+  codes = RSTRING_PTR( decoders );
+
   for( i = 0; i < argc; i++ )
   {
-    VALUE val;
+    VALUE how = rb_hash_lookup( schema, rb_str_new2( columns[i] ) );
 
-    if( !hook->built_columns )
+    /* a column without a decoder of its own falls back to its declared type */
+    if( NIL_P( how ) && hook->types != Qnil && columns[ i + argc ] != NULL )
     {
-      rb_ary_push( hook->columns, rb_str_new2( columns[i] ) );
-      if( hook->types != Qnil )
-      {
-        VALUE type;
-        char *type_name = columns[ i + argc ];
-        
-        type = rb_str_new2( type_name == NULL ? "STRING" : type_name );
-        rb_hash_aset( hook->types, rb_ary_entry( hook->columns, i ), type );
-        rb_hash_aset( hook->types, INT2FIX(i), type );
-      }
+      VALUE type = rb_funcall( rb_str_new2( columns[ i + argc ] ), rb_intern( "downcase" ), 0 );
+      how = rb_hash_lookup( schema, type );
     }
 
-    if( argv != NULL )
+    codes[i] = SQLITE_RUBY_DECODE_NONE;
+    if( !NIL_P( how ) )
     {
-      val = ( argv[i] ? rb_str_new2( argv[i] ) : Qnil );
+      ID id = SYM2ID( how );
 
-      if( hook->do_translate )
-      {
-        VALUE type = rb_hash_aref( hook->types, INT2FIX(i) );
-        val = rb_funcall( cSQLiteTypeTranslator, idTranslate, 2, type, val );
-      }
+      if( id == idInteger )
+        codes[i] = SQLITE_RUBY_DECODE_INTEGER;
+      else if( id == idFloat )
+        codes[i] = SQLITE_RUBY_DECODE_FLOAT;
+      else if( id == idTime )
+        codes[i] = SQLITE_RUBY_DECODE_TIME;
+      else if( id == idIntern )
+        codes[i] = SQLITE_RUBY_DECODE_INTERN;
 
-      if( hook->self->use_array )
-      {
-        rb_ary_store( result, i, val );
-      }
-      else
-      {
-        rb_hash_aset( result, rb_ary_entry( hook->columns, i ), val );
-        rb_hash_aset( result, INT2FIX(i), val );
-      }
+      if( codes[i] == SQLITE_RUBY_DECODE_INTERN && NIL_P( hook->interned ) )
+        hook->interned = rb_ary_new2( argc );
+
+      used |= codes[i];
     }
   }
 
-  if( hook->self->use_array )
+  if( used )
+    hook->decoders = decoders;
+}
+
+
+/* the stamps are Util::timestamp's 'YYYY-MM-DD HH:MM:SS.uuuuuu' in local
+ * time.  mktime is only called when the hour changes from the last stamp
+ * decoded, which in a scan of jobs ordered by time is rarely. */
+static VALUE static_decode_time( SQLITE_RUBY_CALLBACK *hook, const char *value )
+{
+  static const int  width[ 7 ] = { 4, 2, 2, 2, 2, 2, 6 };
+  static const char sep[ 7 ] = { '-', '-', ' ', ':', ':', '.', 0 };
+  const char *p = value;
+  const char *stamp;
+  int  field[ 7 ];
+  int  i;
+  int  j;
+
+  while( isspace( (unsigned char)*p ) )
+    p++;
+  stamp = p;
+
+  for( i = 0; i < 7; i++ )
   {
-    if( rb_respond_to( result, idFieldsEqual ) )
+    field[i] = 0;
+    for( j = 0; j < width[i]; j++, p++ )
     {
-      rb_funcall( result, idFieldsEqual, 1, hook->columns );
+      if( !isdigit( (unsigned char)*p ) )
+        return Qundef;
+      field[i] = field[i] * 10 + ( *p - '0' );
     }
-    else
+    if( sep[i] )
     {
-      rb_iv_set( result, "@fields", hook->columns );
-      if( !rb_respond_to( result, idFields ) )
-        rb_funcall( result, idInstanceEvalMethod, 1, rb_str_new2( "def fields;@fields;end" ) );
+      if( *p != sep[i] )
+        return Qundef;
+      p++;
     }
   }
 
-  hook->built_columns = 1;
-
-  rb_iv_set( result, "@argument", hook->arg );
-  rb_funcall( result, idInstanceEvalMethod, 1, rb_str_new2( "def argument;@argument;end" ) );
+  while( isspace( (unsigned char)*p ) )
+    p++;
+  if( *p )
+    return Qundef;
 
-  if( hook->types != Qnil )
+  if( strncmp( stamp, hook->stamp_hour, 13 ) != 0 )
   {
-    rb_iv_set( result, "@column_types", hook->types );
-    rb_funcall( result, idInstanceEvalMethod, 1, rb_str_new2( "def column_types;@column_types;end" ) );
+    struct tm tm;
+    time_t base;
+
+    memset( &tm, 0, sizeof( tm ) );
+    tm.tm_year = field[0] - 1900;
+    tm.tm_mon = field[1] - 1;
+    tm.tm_mday = field[2];
+    tm.tm_hour = field[3];
+    tm.tm_isdst = -1;
+
+    base = mktime( &tm );
+    if( base == (time_t)-1 )
+      return Qundef;
+
+    memcpy( hook->stamp_hour, stamp, 13 );
+    hook->stamp_hour[ 13 ] = 0;
+    hook->stamp_base = base;
   }
 
-  rc = rb_funcall( hook->callback, idCallMethod, 1, result );
-
-  return ( rc == oSQLiteQueryAbort ? 1 : 0 );
+  return rb_time_new( hook->stamp_base + field[4] * 60 + field[5], field[6] );
 }
 
 
-static void static_custom_function_callback( sqlite_func* ctx, int argc, const char **argv )
+/* columns like state and runner hold a handful of values repeated over every
+ * row; handing out one frozen string per value spares allocating each cell.
+ * Past SQLITE_RUBY_INTERN_MAX values the column evidently isn't one of those,
+ * and new values get fresh strings as usual. */
+static VALUE static_intern_value( SQLITE_RUBY_CALLBACK *hook, int column, const char *value )
 {
-  SQLITE_CUSTOM_FUNCTION_CB *data;
-  VALUE rc;
-  VALUE args;
-  int i;
+  VALUE seen = rb_ary_entry( hook->interned, column );
+  VALUE str;
+  long  len = (long)strlen( value );
+  long  i;
 
-  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
-
-  args = rb_ary_new2( argc );
-  rb_ary_push( args, Data_Wrap_Struct( cSQLiteQueryContext, 0, 0, ctx ) );
-
-  for( i = 0; i < argc; i++ )
+  if( NIL_P( seen ) )
   {
-    if( argv[i] )
-      rb_ary_push( args, rb_str_new2( argv[i] ) );
-    else
-      rb_ary_push( args, Qnil );
+    seen = rb_ary_new();
+    rb_ary_store( hook->interned, column, seen );
   }
 
-  rc = rb_apply( data->callback, idCallMethod, args );
-
-  switch( TYPE(rc) )
+  for( i = 0; i < RARRAY_LEN( seen ); i++ )
   {
-    case T_STRING:
-      sqlite_set_result_string( ctx, (const char *)StringValuePtr(rc), RSTRING_LEN(rc) );
-      break;
-    case T_FIXNUM:
-      sqlite_set_result_int( ctx, FIX2INT(rc) );
-      break;
-    case T_FLOAT:
-      sqlite_set_result_double( ctx, NUM2DBL(rc) );
-      break;
+    str = rb_ary_entry( seen, i );
+    if( RSTRING_LEN( str ) == len && memcmp( RSTRING_PTR( str ), value, len ) == 0 )
+      return str;
   }
+
+  if( RARRAY_LEN( seen ) >= SQLITE_RUBY_INTERN_MAX )
+    return Qundef;
+
+  str = rb_obj_freeze( rb_str_new( value, len ) );
+  rb_ary_push( seen, str );
+
+  return str;
 }
 
 
-static void static_custom_aggregate_callback( sqlite_func* ctx, int argc, const char **argv )
+static VALUE static_decode_value( SQLITE_RUBY_CALLBACK *hook, int how, int column, const char *value )
 {
-  SQLITE_CUSTOM_FUNCTION_CB *data;
-  VALUE args;
-  VALUE *hash;
-  int i;
+  char *end;
 
-  hash = (VALUE*)sqlite_aggregate_context( ctx, sizeof( VALUE ) );
-  if( *hash == 0 ) *hash = rb_hash_new();
+  switch( how )
+  {
+    case SQLITE_RUBY_DECODE_INTEGER:
+    {
+      long long n;
+
+      errno = 0;
+      n = strtoll( value, &end, 10 );
+      if( end == value || *end )
+        return Qundef;
+      if( errno == ERANGE )
+        return rb_cstr2inum( value, 10 );
+      return LL2NUM( n );
+    }
 
-  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
+    case SQLITE_RUBY_DECODE_FLOAT:
+    {
+      double d = strtod( value, &end );
 
-  args = rb_ary_new2( argc );
-  rb_ary_push( args, Data_Wrap_Struct( cSQLiteQueryContext, 0, 0, ctx ) );
+      if( end == value || *end )
+        return Qundef;
+      return rb_float_new( d );
+    }
 
-  for( i = 0; i < argc; i++ )
-  {
-    if( argv[i] )
-      rb_ary_push( args, rb_str_new2( argv[i] ) );
-    else
-      rb_ary_push( args, Qnil );
+    case SQLITE_RUBY_DECODE_TIME:
+      return static_decode_time( hook, value );
+
+    case SQLITE_RUBY_DECODE_INTERN:
+      return static_intern_value( hook, column, value );
   }
 
-  rb_apply( data->callback, idCallMethod, args );
+  return Qundef;
 }
 
 
-static void static_custom_finalize_callback( sqlite_func* ctx )
+static VALUE static_build_row( SQLITE_RUBY_CALLBACK *hook, int argc, char **argv, char **columns )
 {
-  SQLITE_CUSTOM_FUNCTION_CB *data;
-  VALUE rc;
+  VALUE result;
   int i;
 
-  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
-  rc = rb_funcall( data->finalize, idCallMethod, 1, Data_Wrap_Struct( cSQLiteQueryContext, 0, 0, ctx ) );
-
-  switch( TYPE(rc) )
+  if( !hook->built_columns )
   {
-    case T_STRING:
-      sqlite_set_result_string( ctx, (const char *)StringValuePtr(rc), RSTRING_LEN(rc) );
-      break;
-    case T_FIXNUM:
-      sqlite_set_result_int( ctx, FIX2INT(rc) );
-      break;
-    case T_FLOAT:
-      sqlite_set_result_double( ctx, NUM2DBL(rc) );
-      break;
+    static_build_fieldset( hook, argc, columns );
   }
-}
 
-static int static_pragma_enabled_callback( void *arg, int argc, char **argv, char **columnNames )
-{
-  int *result = (int*)arg;
+  if( hook->schema != hook->self->decoders )
+  {
+    static_build_decoders( hook, argc, columns );
+  }
 
-  if( ( strcmp( argv[0], "ON" ) == 0 ) || ( strcmp( argv[0], "1" ) == 0 ) )
+  if( hook->self->use_array )
   {
-    *result = 1;
+    result = rb_obj_alloc( cSQLiteRow );
   }
   else
   {
-    *result = 0;
+    result = rb_obj_alloc( cSQLiteHashRow );
   }
 
-  return SQLITE_OK;
-}
-
-static int static_pragma_enabled( sqlite* db, const char *pragma )
-{
-  int result;
-  int return_code;
-  char sql[ 256 ];
-  char *msg;
-
-  sprintf( sql, "PRAGMA %s", pragma );
-  return_code = sqlite_exec( db, sql, static_pragma_enabled_callback, &result, &msg );
-
-  if( return_code != SQLITE_OK )
+  if( argv != NULL )
   {
-    VALUE err = rb_str_new2( msg );
-    free( msg );
+    for( i = 0; i < argc; i++ )
+    {
+      VALUE val = Qundef;
+      int   how = ( hook->decoders == Qnil ? SQLITE_RUBY_DECODE_NONE : RSTRING_PTR( hook->decoders )[i] );
 
-    static_raise_db_error( return_code,
-                           "could not determine status of pragma '%s' (%s)",
-                           pragma, StringValuePtr(err) );
-  }
+      /* a cell its decoder can't parse is left as a string */
+      if( argv[i] && how != SQLITE_RUBY_DECODE_NONE )
+        val = static_decode_value( hook, how, i, argv[i] );
 
-  return result;
-}
+      if( val == Qundef )
+      {
+        val = ( argv[i] ? rb_str_new2( argv[i] ) : Qnil );
+        how = SQLITE_RUBY_DECODE_NONE;
+      }
 
+      /* decoded cells already have their ruby type */
+      if( hook->do_translate && how == SQLITE_RUBY_DECODE_NONE )
+      {
+        VALUE type = rb_hash_aref( hook->types, INT2FIX(i) );
+        val = rb_funcall( cSQLiteTypeTranslator, idTranslate, 2, type, val );
+      }
 
-/**
- * Opens a SQLite database. If the database does not exist, it will be
- * created. The mode parameter is currently unused and should be set to 0.
- */
-static VALUE static_database_new( VALUE klass,
+      if( hook->self->use_array )
+      {
+        rb_ary_store( result, i, val );
+      }
+      else
+      {
+        rb_hash_aset( result, rb_ary_entry( hook->columns, i ), val );
+        rb_hash_aset( result, INT2FIX(i), val );
+      }
+    }
+  }
+
+  rb_ivar_set( result, idIvFieldset, hook->fieldset );
+
+  return result;
+}
+
+
+static VALUE static_ruby_sqlite_callback_body( VALUE pArgs )
+{
+  SQLITE_RUBY_CALLBACK_ARGS *args = (SQLITE_RUBY_CALLBACK_ARGS*)pArgs;
+  VALUE result;
+
+  result = static_build_row( args->hook, args->argc, args->argv, args->columns );
+
+  return rb_funcall( args->hook->callback, idCallMethod, 1, result );
+}
+
+
+static int static_ruby_sqlite_callback( void *pArg, int argc, char **argv, char **columns )
+{
+  SQLITE_RUBY_CALLBACK *hook = (SQLITE_RUBY_CALLBACK*)pArg;
+  SQLITE_RUBY_CALLBACK_ARGS args;
+  VALUE rc;
+
+  if( hook->self->trace )
+    hook->self->trace->rows++;
+
+  args.hook = hook;
+  args.ctx = NULL;
+  args.argc = argc;
+  args.argv = argv;
+  args.columns = columns;
+
+  rc = static_call_ruby( hook->self, static_ruby_sqlite_callback_body, &args );
+
+  /* an exception in the callback aborts the query, and is rethrown by #exec */
+  return ( rc == oSQLiteQueryAbort || hook->self->pending ? 1 : 0 );
+}
+
+
+/* the bodies of the engine calls made by static_run_engine; no ruby API may
+ * be used in them, since they run without the interpreter lock */
+
+static void *static_exec_without_gvl( void *pCall )
+{
+  SQLITE_RUBY_ENGINE_CALL *call = (SQLITE_RUBY_ENGINE_CALL*)pCall;
+
+  call->rc = sqlite_exec( call->hdb->db, call->sql, call->callback, call->arg, call->err );
+  return NULL;
+}
+
+static void *static_step_without_gvl( void *pCall )
+{
+  SQLITE_RUBY_ENGINE_CALL *call = (SQLITE_RUBY_ENGINE_CALL*)pCall;
+
+  call->rc = sqlite_step( call->vm, &call->argc, &call->values, &call->columns );
+  return NULL;
+}
+
+
+#ifdef SQLITE_RUBY_RELEASE_GVL
+/* called by the interpreter to wake a thread blocked in the engine, when the
+ * thread is killed, sent an exception, or the process takes a signal.  Most
+ * signals (a SIGCHLD, say) raise nothing, so the statement is not aborted
+ * here: the busy handler, where the engine blocks, sees the flag and lets the
+ * interpreter decide.  Row callbacks run ruby code, which checks by itself. */
+static void static_interrupt_engine( void *pHdb )
+{
+  SQLITE_RUBY_DATA *hdb = (SQLITE_RUBY_DATA*)pHdb;
+
+  hdb->busy.interrupted = 1;
+}
+
+/* runs a callback body under rb_protect, with the interpreter lock held */
+typedef struct
+{
+  VALUE (*func)( VALUE );
+  VALUE arg;
+  VALUE result;
+  int   state;
+} SQLITE_RUBY_PROTECTED_CALL;
+
+static void *static_protected_call( void *pCall )
+{
+  SQLITE_RUBY_PROTECTED_CALL *call = (SQLITE_RUBY_PROTECTED_CALL*)pCall;
+
+  call->result = rb_protect( call->func, call->arg, &call->state );
+  return NULL;
+}
+#endif
+
+
+static void static_run_engine( SQLITE_RUBY_DATA *hdb, void *(*func)( void * ), SQLITE_RUBY_ENGINE_CALL *call )
+{
+  VALUE owner = hdb->owner;
+  int   unlocked = hdb->unlocked;
+#ifdef SQLITE_RUBY_RELEASE_GVL
+  int   tries;
+#endif
+
+  static_check_owner( hdb );
+
+  call->hdb = hdb;
+  static_busy_reset( hdb );
+  hdb->owner = rb_thread_current();
+
+#ifdef SQLITE_RUBY_RELEASE_GVL
+  /* func is never called if an interrupt is already pending.  The
+   * interpreter runs it (raising, if that's what it is) and we go again; if
+   * it is still pending after that, masked by Thread.handle_interrupt say,
+   * the engine runs with the lock held instead */
+  for( tries = 0; ; tries++ )
+  {
+    call->rc = -1;
+    hdb->unlocked = 1;
+    rb_thread_call_without_gvl2( func, call, static_interrupt_engine, hdb );
+    hdb->unlocked = unlocked;
+
+    if( call->rc != -1 || tries > 0 )
+      break;
+
+    hdb->owner = owner;
+    rb_thread_check_ints();
+    hdb->owner = rb_thread_current();
+  }
+
+  if( call->rc == -1 )
+    func( call );
+#else
+  func( call );
+#endif
+
+  hdb->unlocked = unlocked;
+  hdb->owner = owner;
+}
+
+
+static VALUE static_call_ruby( SQLITE_RUBY_DATA *hdb, VALUE (*func)( VALUE ), SQLITE_RUBY_CALLBACK_ARGS *args )
+{
+  SQLITE_RUBY_TRACE *trace = hdb->trace;
+  VALUE result = Qnil;
+  int   state = 0;
+
+  /* once a callback has raised, the rest of the query only runs down */
+  if( hdb->pending )
+    return Qnil;
+
+  /* statements the callback runs are not part of the one being traced */
+  hdb->trace = NULL;
+
+#ifdef SQLITE_RUBY_RELEASE_GVL
+  if( hdb->unlocked )
+  {
+    SQLITE_RUBY_PROTECTED_CALL call;
+
+    call.func = func;
+    call.arg = (VALUE)args;
+    call.result = Qnil;
+    call.state = 0;
+
+    /* the callback may itself use the database, with the lock held */
+    hdb->unlocked = 0;
+    rb_thread_call_with_gvl( static_protected_call, &call );
+    hdb->unlocked = 1;
+
+    result = call.result;
+    state = call.state;
+  }
+  else
+#endif
+    result = rb_protect( func, (VALUE)args, &state );
+
+  hdb->trace = trace;
+
+  if( state )
+    hdb->pending = state;
+
+  return result;
+}
+
+
+static void static_raise_pending( SQLITE_RUBY_DATA *hdb )
+{
+  int state = hdb->pending;
+
+  if( state )
+  {
+    hdb->pending = 0;
+    rb_jump_tag( state );
+  }
+
+#ifdef SQLITE_RUBY_RELEASE_GVL
+  /* let a kill or Thread#raise that interrupted the engine take effect
+   * before any error the interruption caused is reported */
+  rb_thread_check_ints();
+#endif
+}
+
+
+static void static_check_owner( SQLITE_RUBY_DATA *hdb )
+{
+  if( hdb != NULL && hdb->owner != Qnil && hdb->owner != rb_thread_current() )
+    static_raise_db_error( SQLITE_MISUSE, "database is in use by another thread" );
+}
+
+
+static void static_busy_reset( SQLITE_RUBY_DATA *hdb )
+{
+  hdb->busy.attempts = 0;
+  hdb->busy.interrupted = 0;
+}
+
+
+static VALUE static_check_interrupts_body( VALUE unused )
+{
+  rb_thread_check_ints();
+  return Qnil;
+}
+
+
+/* this runs inside the engine, usually without the interpreter lock, so it
+ * must not touch any ruby object except through static_call_ruby.
+ * Returning zero gives up, and the engine reports SQLITE_BUSY. */
+static int static_busy_handler( void *pHdb, const char *table, int count )
+{
+  SQLITE_RUBY_DATA *hdb = (SQLITE_RUBY_DATA*)pHdb;
+  SQLITE_RUBY_BUSY *busy = &hdb->busy;
+  struct timeval now;
+  long elapsed;
+  long wait;
+  long i;
+
+  /* an interrupt that raises ends the wait, and is rethrown once the engine
+   * returns; any other kind leaves it to carry on */
+  if( busy->interrupted )
+  {
+    busy->interrupted = 0;
+    if( hdb->unlocked )
+      static_call_ruby( hdb, static_check_interrupts_body, NULL );
+    if( hdb->pending )
+      return 0;
+  }
+
+  gettimeofday( &now, NULL );
+  if( busy->attempts == 0 )
+    busy->start = now;
+
+  elapsed = ( now.tv_sec - busy->start.tv_sec ) * 1000000L
+          + ( now.tv_usec - busy->start.tv_usec );
+  if( elapsed >= busy->timeout )
+    return 0;
+
+  wait = busy->first;
+  for( i = 0; i < busy->attempts && wait < busy->max; i++ )
+    wait *= 2;
+  if( wait > busy->max )
+    wait = busy->max;
+
+  /* spread contending processes out so they don't retry in lockstep */
+  wait -= (long)( ( (double)rand_r( &busy->seed ) / RAND_MAX ) * ( wait / 2 ) );
+
+  if( wait > busy->timeout - elapsed )
+    wait = busy->timeout - elapsed;
+
+  busy->attempts++;
+  usleep( (useconds_t)wait );
+
+  return 1;
+}
+
+
+/* like the busy handler this runs inside the engine without the interpreter
+ * lock, so it only counts.  Returning nonzero would turn the commit into a
+ * rollback. */
+static int static_commit_hook( void *pHdb )
+{
+  SQLITE_RUBY_DATA *hdb = (SQLITE_RUBY_DATA*)pHdb;
+
+  hdb->commits++;
+
+  return 0;
+}
+
+
+static char *static_sql_shape( const char *sql )
+{
+  char *shape;
+  const char *p;
+  int n = 0;
+
+  shape = (char *)malloc( SQLITE_RUBY_SHAPE_MAX + 1 );
+  if( shape == NULL )
+    return NULL;
+
+  for( p = sql; *p && n < SQLITE_RUBY_SHAPE_MAX; )
+  {
+    if( isspace( (unsigned char)*p ) )
+    {
+      while( isspace( (unsigned char)*p ) ) p++;
+      if( n > 0 && *p ) shape[n++] = ' ';
+    }
+    else if( *p == '\'' )
+    {
+      /* a string literal, where '' is an escaped quote */
+      for( p++; *p; p++ )
+        if( *p == '\'' && *++p != '\'' )
+          break;
+      shape[n++] = '?';
+    }
+    else if( isdigit( (unsigned char)*p ) &&
+             ( n == 0 || !( isalnum( (unsigned char)shape[n-1] ) || shape[n-1] == '_' ) ) )
+    {
+      while( isalnum( (unsigned char)*p ) || *p == '.' ) p++;
+      shape[n++] = '?';
+    }
+    else if( *p == ';' )
+      p++;
+    else
+      shape[n++] = *p++;
+  }
+
+  while( n > 0 && shape[n-1] == ' ' ) n--;
+  shape[n] = '\0';
+
+  return shape;
+}
+
+
+static void static_profile_record( const char *shape, double usecs, unsigned long rows )
+{
+  SQLITE_RUBY_SHAPE *entry;
+  int exp;
+  int bucket = 0;
+  double m;
+
+  if( shape == NULL )
+    return;
+
+  /* bucket b holds [ 2^(b/4) * (1 + (b%4)/4), 2^(b/4) * (1 + (b%4+1)/4) ) */
+  if( usecs >= 1 )
+  {
+    m = frexp( usecs, &exp );
+    bucket = ( exp - 1 ) * 4 + (int)( ( m - 0.5 ) * 8 );
+    if( bucket >= SQLITE_RUBY_PROFILE_BUCKETS )
+      bucket = SQLITE_RUBY_PROFILE_BUCKETS - 1;
+  }
+
+  pthread_mutex_lock( &g_profile_mutex );
+
+  for( entry = g_profile; entry != NULL; entry = entry->next )
+    if( strcmp( entry->shape, shape ) == 0 )
+      break;
+
+  if( entry == NULL )
+  {
+    entry = (SQLITE_RUBY_SHAPE *)calloc( 1, sizeof( SQLITE_RUBY_SHAPE ) );
+    if( entry != NULL )
+      entry->shape = strdup( shape );
+    if( entry == NULL || entry->shape == NULL )
+    {
+      if( entry ) free( entry );
+      pthread_mutex_unlock( &g_profile_mutex );
+      return;
+    }
+    entry->next = g_profile;
+    g_profile = entry;
+  }
+
+  entry->count++;
+  entry->rows += rows;
+  entry->usecs += usecs;
+  entry->buckets[bucket]++;
+
+  pthread_mutex_unlock( &g_profile_mutex );
+}
+
+
+static double static_elapsed_usecs( struct timeval *from, struct timeval *to )
+{
+  return ( to->tv_sec - from->tv_sec ) * 1000000.0 + ( to->tv_usec - from->tv_usec );
+}
+
+
+static void static_trace_finish( SQLITE_RUBY_TRACE *trace, struct timeval *now )
+{
+  if( trace->shape != NULL )
+  {
+    static_profile_record( trace->shape, static_elapsed_usecs( &trace->start, now ), trace->rows );
+    free( trace->shape );
+    trace->shape = NULL;
+  }
+  trace->rows = 0;
+}
+
+
+/* this runs inside the engine, usually without the interpreter lock */
+static void static_trace_callback( void *pHdb, const char *sql )
+{
+  SQLITE_RUBY_DATA *hdb = (SQLITE_RUBY_DATA*)pHdb;
+  struct timeval now;
+
+  if( hdb->trace == NULL )
+    return;
+
+  /* compiling the next statement of the text finishes the one before */
+  gettimeofday( &now, NULL );
+  static_trace_finish( hdb->trace, &now );
+
+  hdb->trace->shape = static_sql_shape( sql );
+  hdb->trace->start = now;
+}
+
+
+static void static_statement_record( SQLITE_RUBY_STATEMENT *stmt )
+{
+  if( stmt->timed )
+  {
+    if( stmt->shape == NULL )
+      stmt->shape = static_sql_shape( RSTRING_PTR( stmt->sql ) );
+    static_profile_record( stmt->shape, stmt->usecs, stmt->rows );
+  }
+
+  stmt->timed = 0;
+  stmt->usecs = 0;
+  stmt->rows = 0;
+}
+
+
+static VALUE static_custom_function_args( SQLITE_RUBY_CALLBACK_ARGS *cb_args )
+{
+  VALUE args;
+  int i;
+
+  args = rb_ary_new2( cb_args->argc + 1 );
+  rb_ary_push( args, Data_Wrap_Struct( cSQLiteQueryContext, 0, 0, cb_args->ctx ) );
+
+  for( i = 0; i < cb_args->argc; i++ )
+  {
+    if( cb_args->argv[i] )
+      rb_ary_push( args, rb_str_new2( cb_args->argv[i] ) );
+    else
+      rb_ary_push( args, Qnil );
+  }
+
+  return args;
+}
+
+
+static void static_custom_function_failed( SQLITE_CUSTOM_FUNCTION_CB *data, sqlite_func *ctx )
+{
+  if( data->hdb->pending )
+    sqlite_set_result_error( ctx, "exception raised in custom function", -1 );
+}
+
+
+static VALUE static_custom_function_body( VALUE pArgs )
+{
+  SQLITE_RUBY_CALLBACK_ARGS *cb_args = (SQLITE_RUBY_CALLBACK_ARGS*)pArgs;
+  SQLITE_CUSTOM_FUNCTION_CB *data;
+  sqlite_func *ctx = cb_args->ctx;
+  VALUE rc;
+
+  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
+
+  rc = rb_apply( data->callback, idCallMethod, static_custom_function_args( cb_args ) );
+
+  switch( TYPE(rc) )
+  {
+    case T_STRING:
+      sqlite_set_result_string( ctx, (const char *)StringValuePtr(rc), RSTRING_LEN(rc) );
+      break;
+    case T_FIXNUM:
+      sqlite_set_result_int( ctx, FIX2INT(rc) );
+      break;
+    case T_FLOAT:
+      sqlite_set_result_double( ctx, NUM2DBL(rc) );
+      break;
+  }
+
+  return Qnil;
+}
+
+
+static void static_custom_function_callback( sqlite_func* ctx, int argc, const char **argv )
+{
+  SQLITE_CUSTOM_FUNCTION_CB *data;
+  SQLITE_RUBY_CALLBACK_ARGS args;
+
+  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
+
+  args.hook = NULL;
+  args.ctx = ctx;
+  args.argc = argc;
+  args.argv = (char **)argv;
+  args.columns = NULL;
+
+  static_call_ruby( data->hdb, static_custom_function_body, &args );
+  static_custom_function_failed( data, ctx );
+}
+
+
+static VALUE static_custom_aggregate_body( VALUE pArgs )
+{
+  SQLITE_RUBY_CALLBACK_ARGS *cb_args = (SQLITE_RUBY_CALLBACK_ARGS*)pArgs;
+  SQLITE_CUSTOM_FUNCTION_CB *data;
+  sqlite_func *ctx = cb_args->ctx;
+  VALUE *hash;
+
+  hash = (VALUE*)sqlite_aggregate_context( ctx, sizeof( VALUE ) );
+  if( *hash == 0 ) *hash = rb_hash_new();
+
+  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
+
+  rb_apply( data->callback, idCallMethod, static_custom_function_args( cb_args ) );
+
+  return Qnil;
+}
+
+
+static void static_custom_aggregate_callback( sqlite_func* ctx, int argc, const char **argv )
+{
+  SQLITE_CUSTOM_FUNCTION_CB *data;
+  SQLITE_RUBY_CALLBACK_ARGS args;
+
+  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
+
+  args.hook = NULL;
+  args.ctx = ctx;
+  args.argc = argc;
+  args.argv = (char **)argv;
+  args.columns = NULL;
+
+  static_call_ruby( data->hdb, static_custom_aggregate_body, &args );
+  static_custom_function_failed( data, ctx );
+}
+
+
+static VALUE static_custom_finalize_body( VALUE pArgs )
+{
+  SQLITE_RUBY_CALLBACK_ARGS *cb_args = (SQLITE_RUBY_CALLBACK_ARGS*)pArgs;
+  SQLITE_CUSTOM_FUNCTION_CB *data;
+  sqlite_func *ctx = cb_args->ctx;
+  VALUE rc;
+
+  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
+  rc = rb_funcall( data->finalize, idCallMethod, 1, Data_Wrap_Struct( cSQLiteQueryContext, 0, 0, ctx ) );
+
+  switch( TYPE(rc) )
+  {
+    case T_STRING:
+      sqlite_set_result_string( ctx, (const char *)StringValuePtr(rc), RSTRING_LEN(rc) );
+      break;
+    case T_FIXNUM:
+      sqlite_set_result_int( ctx, FIX2INT(rc) );
+      break;
+    case T_FLOAT:
+      sqlite_set_result_double( ctx, NUM2DBL(rc) );
+      break;
+  }
+
+  return Qnil;
+}
+
+
+static void static_custom_finalize_callback( sqlite_func* ctx )
+{
+  SQLITE_CUSTOM_FUNCTION_CB *data;
+  SQLITE_RUBY_CALLBACK_ARGS args;
+
+  data = (SQLITE_CUSTOM_FUNCTION_CB*)sqlite_user_data( ctx );
+
+  args.hook = NULL;
+  args.ctx = ctx;
+  args.argc = 0;
+  args.argv = NULL;
+  args.columns = NULL;
+
+  static_call_ruby( data->hdb, static_custom_finalize_body, &args );
+  static_custom_function_failed( data, ctx );
+}
+
+static int static_pragma_enabled_callback( void *arg, int argc, char **argv, char **columnNames )
+{
+  int *result = (int*)arg;
+
+  if( ( strcmp( argv[0], "ON" ) == 0 ) || ( strcmp( argv[0], "1" ) == 0 ) )
+  {
+    *result = 1;
+  }
+  else
+  {
+    *result = 0;
+  }
+
+  return SQLITE_OK;
+}
+
+static int static_pragma_enabled( sqlite* db, const char *pragma )
+{
+  int result;
+  int return_code;
+  char sql[ 256 ];
+  char *msg;
+
+  sprintf( sql, "PRAGMA %s", pragma );
+  return_code = sqlite_exec( db, sql, static_pragma_enabled_callback, &result, &msg );
+
+  if( return_code != SQLITE_OK )
+  {
+    VALUE err = rb_str_new2( msg );
+    free( msg );
+
+    static_raise_db_error( return_code,
+                           "could not determine status of pragma '%s' (%s)",
+                           pragma, StringValuePtr(err) );
+  }
+
+  return result;
+}
+
+
+/**
+ * Opens a SQLite database. If the database does not exist, it will be
+ * created. The mode parameter is currently unused and should be set to 0.
+ */
+static VALUE static_database_new( VALUE klass,
                                   VALUE dbname,
                                   VALUE mode )
 {
@@ -456,6 +1492,22 @@ static VALUE static_database_new( VALUE klass,
   hdb = ALLOC( SQLITE_RUBY_DATA );
   hdb->db = db;
   hdb->use_array = 0; /* default to FALSE */
+  hdb->statements = NULL;
+  hdb->owner = Qnil;
+  hdb->unlocked = 0;
+  hdb->pending = 0;
+  hdb->busy.first = 0;
+  hdb->busy.max = 0;
+  hdb->busy.timeout = 0;
+  hdb->busy.attempts = 0;
+  hdb->busy.seed = (unsigned int)( time( NULL ) ^ getpid() ^ (long)hdb );
+  hdb->busy.interrupted = 0;
+  hdb->trace = NULL;
+  hdb->commits = 0;
+  hdb->decoders = Qnil;
+
+  sqlite_trace( db, static_trace_callback, hdb );
+  sqlite_commit_hook( db, static_commit_hook, hdb );
 
   v_db = Data_Wrap_Struct( klass, NULL, static_free_database_handle, hdb );
 
@@ -474,8 +1526,10 @@ static VALUE static_database_close( VALUE self )
   SQLITE_RUBY_DATA *hdb;
 
   Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
+  static_check_owner( hdb );
   if( hdb->db != NULL )
   {
+    static_finalize_statements( hdb );
     sqlite_close( hdb->db );
     hdb->db = NULL;
   }
@@ -498,6 +1552,10 @@ static VALUE static_database_exec( VALUE self,
 {
   SQLITE_RUBY_DATA *hdb;
   SQLITE_RUBY_CALLBACK hook;
+  SQLITE_RUBY_ENGINE_CALL call;
+  SQLITE_RUBY_TRACE trace;
+  SQLITE_RUBY_TRACE *outer;
+  struct timeval now;
   const char *s_sql;
   int i;
   char *err = NULL;
@@ -509,11 +1567,18 @@ static VALUE static_database_exec( VALUE self,
   Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
   if( hdb->db == NULL )
     static_raise_db_error( -1, "attempt to access a closed database" );
+  static_check_owner( hdb );
+  static_busy_reset( hdb );
 
   hook.callback = callback;
   hook.arg = parm;
   hook.built_columns = 0;
   hook.columns = Qnil;
+  hook.fieldset = Qnil;
+  hook.schema = Qundef;
+  hook.decoders = Qnil;
+  hook.interned = Qnil;
+  hook.stamp_hour[0] = 0;
   hook.self = hdb;
   hook.do_translate = ( rb_iv_get( self, "@type_translation" ) == Qtrue );
 
@@ -527,30 +1592,355 @@ static VALUE static_database_exec( VALUE self,
     hook.do_translate = 0; /* show_datatypes must be anbled for type translation */
   }
 
-  i = sqlite_exec( hdb->db,
-                   s_sql,
-                   static_ruby_sqlite_callback,
-                   &hook,
-                   &err );
+  call.sql = s_sql;
+  call.callback = static_ruby_sqlite_callback;
+  call.arg = &hook;
+  call.err = &err;
+
+  outer = hdb->trace;
+  trace.shape = NULL;
+  trace.rows = 0;
+  hdb->trace = g_profiling ? &trace : NULL;
+
+  static_run_engine( hdb, static_exec_without_gvl, &call );
+  i = call.rc;
+
+  if( hdb->trace )
+  {
+    gettimeofday( &now, NULL );
+    static_trace_finish( &trace, &now );
+  }
+  hdb->trace = outer;
+
+  if( err != 0 )
+  {
+    v_err = rb_str_new2( err );
+    free( err );
+  }
+  else
+    v_err = rb_str_new2( sqlite_error_string( i ) );
+
+  static_raise_pending( hdb );
+
+  switch( i )
+  {
+    case SQLITE_OK:
+    case SQLITE_ABORT:
+      break;
+    default:
+      static_raise_db_error( i, "%s", (const char *)StringValuePtr(v_err) );
+  }
+
+  return INT2FIX(0);
+}
+
+
+/* the state of an #insert_many, shared with its ensure clause */
+typedef struct
+{
+  SQLITE_RUBY_DATA *hdb;
+  sqlite_vm *vm;
+  VALUE sql;
+  VALUE rows;
+  long  ncolumns;
+  long  inserted;
+  struct timeval start;
+} SQLITE_RUBY_INSERT;
+
+static VALUE static_insert_rows( VALUE pInsert )
+{
+  SQLITE_RUBY_INSERT *ins = (SQLITE_RUBY_INSERT*)pInsert;
+  SQLITE_RUBY_ENGINE_CALL call;
+  char *err;
+  long i;
+  long j;
+  int rc;
+
+  for( i = 0; i < RARRAY_LEN( ins->rows ); i++ )
+  {
+    VALUE row = rb_ary_entry( ins->rows, i );
+
+    Check_Type( row, T_ARRAY );
+    if( RARRAY_LEN( row ) != ins->ncolumns )
+      rb_raise( rb_eArgError, "row %ld has %ld values for %ld columns",
+                i, (long)RARRAY_LEN( row ), ins->ncolumns );
+
+    for( j = 0; j < ins->ncolumns; j++ )
+    {
+      VALUE value = rb_ary_entry( row, j );
+
+      if( !NIL_P( value ) )
+        value = rb_obj_as_string( value );
+
+      rc = sqlite_bind( ins->vm, (int)j + 1,
+                        NIL_P( value ) ? NULL : RSTRING_PTR( value ),
+                        NIL_P( value ) ? 0 : (int)RSTRING_LEN( value ) + 1,
+                        1 );
+      if( rc != SQLITE_OK )
+        static_raise_db_error( rc, "could not bind parameter %ld (%s)", j + 1, sqlite_error_string( rc ) );
+    }
+
+    call.vm = ins->vm;
+    static_run_engine( ins->hdb, static_step_without_gvl, &call );
+
+    /* an insert produces no rows, so anything but DONE is a failure whose
+     * real code and message come from the reset */
+    err = NULL;
+    rc = sqlite_reset( ins->vm, &err );
+    if( call.rc != SQLITE_DONE )
+    {
+      VALUE v_err = rb_str_new2( err ? err : sqlite_error_string( rc ) );
+      if( err ) free( err );
+
+      static_raise_pending( ins->hdb );
+      static_raise_db_error( rc == SQLITE_OK ? call.rc : rc, "%s",
+                             (const char *)StringValuePtr( v_err ) );
+    }
+    if( err ) free( err );
+
+    ins->inserted++;
+  }
+
+  return LONG2NUM( ins->inserted );
+}
+
+static VALUE static_insert_finalize( VALUE pInsert )
+{
+  SQLITE_RUBY_INSERT *ins = (SQLITE_RUBY_INSERT*)pInsert;
+  struct timeval now;
+  char *shape;
+
+  sqlite_finalize( ins->vm, NULL );
+  ins->vm = NULL;
+
+  /* the whole batch counts as one run of the insert */
+  if( g_profiling )
+  {
+    gettimeofday( &now, NULL );
+    shape = static_sql_shape( RSTRING_PTR( ins->sql ) );
+    static_profile_record( shape, static_elapsed_usecs( &ins->start, &now ), ins->inserted );
+    if( shape ) free( shape );
+  }
+
+  return Qnil;
+}
+
+/**
+ * Inserts every row of +rows+, an array of arrays holding one value for each
+ * of +columns+, into +table+. The insert is compiled once and then bound and
+ * stepped for each row, so a large batch costs one parse and no string
+ * building in ruby. Values are bound as their string form, or NULL for nil.
+ * Returns the number of rows inserted. Rows inserted before a failure are
+ * not removed, so this should be called inside a transaction.
+ */
+static VALUE static_insert_many( VALUE self,
+                                 VALUE table,
+                                 VALUE columns,
+                                 VALUE rows )
+{
+  SQLITE_RUBY_DATA *hdb;
+  SQLITE_RUBY_INSERT ins;
+  VALUE sql;
+  long i;
+
+  Check_Type( table, T_STRING );
+  Check_Type( columns, T_ARRAY );
+  Check_Type( rows, T_ARRAY );
+
+  if( RARRAY_LEN( columns ) == 0 )
+    rb_raise( rb_eArgError, "no columns to insert" );
+
+  Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
+  if( hdb->db == NULL )
+    static_raise_db_error( -1, "attempt to access a closed database" );
+  static_check_owner( hdb );
+  static_busy_reset( hdb );
+
+  sql = rb_str_new2( "insert into " );
+  rb_str_append( sql, table );
+  rb_str_cat2( sql, " (" );
+  for( i = 0; i < RARRAY_LEN( columns ); i++ )
+  {
+    if( i > 0 ) rb_str_cat2( sql, "," );
+    rb_str_append( sql, rb_obj_as_string( rb_ary_entry( columns, i ) ) );
+  }
+  rb_str_cat2( sql, ") values (" );
+  for( i = 0; i < RARRAY_LEN( columns ); i++ )
+    rb_str_cat2( sql, i > 0 ? ",?" : "?" );
+  rb_str_cat2( sql, ")" );
+
+  ins.hdb = hdb;
+  gettimeofday( &ins.start, NULL );
+  ins.vm = static_compile_vm( hdb->db, (const char *)StringValuePtr( sql ) );
+  ins.sql = sql;
+  ins.rows = rows;
+  ins.ncolumns = RARRAY_LEN( columns );
+  ins.inserted = 0;
+
+  return rb_ensure( static_insert_rows, (VALUE)&ins, static_insert_finalize, (VALUE)&ins );
+}
+
+/**
+ * Turns the statement profiler on or off for every database in the process.
+ * Statements already running when it is turned on are not counted.
+ */
+static VALUE static_set_profiling( VALUE self,
+                                   VALUE on )
+{
+  g_profiling = RTEST( on );
+  return on;
+}
+
+/**
+ * Queries whether the statement profiler is on.
+ */
+static VALUE static_is_profiling( VALUE self )
+{
+  return ( g_profiling ? Qtrue : Qfalse );
+}
+
+/**
+ * Returns the raw totals gathered by the statement profiler, as an array with
+ * one entry per statement shape: [ shape, count, microseconds, rows, buckets ].
+ * Bucket +b+ of the histogram counts runs taking from 2**(b/4)*(1+(b%4)/4.0)
+ * up to 2**(b/4)*(1+(b%4+1)/4.0) microseconds. SQLite.profile summarizes it.
+ */
+static VALUE static_profile_data( VALUE self )
+{
+  SQLITE_RUBY_SHAPE *entry;
+  SQLITE_RUBY_SHAPE *copy = NULL;
+  SQLITE_RUBY_SHAPE *next;
+  VALUE data;
+  VALUE buckets;
+  int i;
+
+  /* copy the totals out first so that no ruby allocation (which may raise)
+   * happens with the mutex held */
+  pthread_mutex_lock( &g_profile_mutex );
+  for( entry = g_profile; entry != NULL; entry = entry->next )
+  {
+    next = (SQLITE_RUBY_SHAPE *)malloc( sizeof( SQLITE_RUBY_SHAPE ) );
+    if( next == NULL ) break;
+    memcpy( next, entry, sizeof( SQLITE_RUBY_SHAPE ) );
+    next->shape = strdup( entry->shape );
+    if( next->shape == NULL ) { free( next ); break; }
+    next->next = copy;
+    copy = next;
+  }
+  pthread_mutex_unlock( &g_profile_mutex );
+
+  data = rb_ary_new();
+  for( entry = copy; entry != NULL; entry = entry->next )
+  {
+    buckets = rb_ary_new2( SQLITE_RUBY_PROFILE_BUCKETS );
+    for( i = 0; i < SQLITE_RUBY_PROFILE_BUCKETS; i++ )
+      rb_ary_push( buckets, ULONG2NUM( entry->buckets[i] ) );
+
+    rb_ary_push( data, rb_ary_new3( 5,
+                                    rb_str_new2( entry->shape ),
+                                    ULONG2NUM( entry->count ),
+                                    rb_float_new( entry->usecs ),
+                                    ULONG2NUM( entry->rows ),
+                                    buckets ) );
+  }
+
+  for( entry = copy; entry != NULL; entry = next )
+  {
+    next = entry->next;
+    free( entry->shape );
+    free( entry );
+  }
+
+  return data;
+}
+
+/**
+ * Discards the totals gathered by the statement profiler.
+ */
+static VALUE static_reset_profile( VALUE self )
+{
+  SQLITE_RUBY_SHAPE *entry;
+  SQLITE_RUBY_SHAPE *next;
+
+  pthread_mutex_lock( &g_profile_mutex );
+  entry = g_profile;
+  g_profile = NULL;
+  pthread_mutex_unlock( &g_profile_mutex );
+
+  for( ; entry != NULL; entry = next )
+  {
+    next = entry->next;
+    free( entry->shape );
+    free( entry );
+  }
+
+  return Qnil;
+}
+
+/**
+ * Sets the number of milliseconds the engine will wait, using sqlite's own
+ * busy handler, for a locked table to become free before raising
+ * BusyException. Zero turns waiting off. This replaces any #busy_backoff.
+ */
+static VALUE static_set_busy_timeout( VALUE self,
+                                      VALUE ms )
+{
+  SQLITE_RUBY_DATA *hdb;
+
+  Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
+  if( hdb->db == NULL )
+    static_raise_db_error( -1, "attempt to access a closed database" );
+
+  sqlite_busy_timeout( hdb->db, NUM2INT( ms ) );
+
+  return ms;
+}
+
+/**
+ * Installs a native busy handler. When a table is locked the engine waits
+ * and retries, first after +first+ seconds, then backing off exponentially
+ * to at most +max+ seconds between attempts, each wait jittered randomly by
+ * up to half. Once +timeout+ seconds have passed in a single call into the
+ * engine it gives up and BusyException is raised. The waiting happens
+ * without the interpreter lock, and a thread that is killed or sent an
+ * exception stops waiting after the current interval. A +timeout+ of nil or
+ * zero removes the handler.
+ */
+static VALUE static_busy_backoff( int argc,
+                                  VALUE *argv,
+                                  VALUE self )
+{
+  SQLITE_RUBY_DATA *hdb;
+  VALUE timeout;
+  VALUE first;
+  VALUE max;
+
+  rb_scan_args( argc, argv, "12", &timeout, &first, &max );
+
+  Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
+  if( hdb->db == NULL )
+    static_raise_db_error( -1, "attempt to access a closed database" );
 
-  if( err != 0 )
+  if( NIL_P( timeout ) || NUM2DBL( timeout ) <= 0 )
   {
-    v_err = rb_str_new2( err );
-    free( err );
+    sqlite_busy_handler( hdb->db, NULL, NULL );
+    hdb->busy.timeout = 0;
+    return self;
   }
 
-  switch( i )
-  {
-    case SQLITE_OK:
-    case SQLITE_ABORT:
-      break;
-    default:
-      static_raise_db_error( i, "%s", (const char *)StringValuePtr(v_err) );
-  }
+  hdb->busy.timeout = (long)( NUM2DBL( timeout ) * 1000000 );
+  hdb->busy.first = NIL_P( first ) ? 100 : (long)( NUM2DBL( first ) * 1000000 );
+  hdb->busy.max = NIL_P( max ) ? 100000 : (long)( NUM2DBL( max ) * 1000000 );
 
-  return INT2FIX(0);
-}
+  if( hdb->busy.first < 1 )
+    hdb->busy.first = 1;
+  if( hdb->busy.max < hdb->busy.first )
+    hdb->busy.max = hdb->busy.first;
+
+  sqlite_busy_handler( hdb->db, static_busy_handler, hdb );
 
+  return self;
+}
 
 /**
  * Returns the key value of the last inserted row.
@@ -584,6 +1974,91 @@ static VALUE static_changes( VALUE self )
 }
 
 
+/**
+ * Returns the number of transactions committed on this database handle,
+ * counted by a commit hook as the engine commits them. Comparing the count
+ * before and after a block of work tells whether anything it wrote, or the
+ * autocommit of a lone statement, actually reached the database.
+ */
+static VALUE static_commits( VALUE self )
+{
+  SQLITE_RUBY_DATA *hdb;
+
+  Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
+
+  if( hdb->db == NULL )
+    static_raise_db_error( -1, "attempt to access a closed database" );
+
+  return ULONG2NUM( hdb->commits );
+}
+
+
+static int static_add_column_decoder( VALUE name, VALUE how, VALUE decoders )
+{
+  ID id;
+
+  name = rb_obj_freeze( rb_str_dup( rb_obj_as_string( name ) ) );
+  id = rb_to_id( how );
+
+  if( id != idInteger && id != idFloat && id != idTime && id != idIntern )
+    rb_raise( rb_eArgError, "unknown column decoder %s for %s",
+              rb_id2name( id ), RSTRING_PTR( name ) );
+
+  rb_hash_aset( decoders, name, ID2SYM( id ) );
+
+  return ST_CONTINUE;
+}
+
+/**
+ * Sets the columns to be decoded natively as rows are built, instead of
+ * arriving as strings. +decoders+ maps a column name, or failing that a
+ * lowercased declared type (when show_datatypes is on), to one of :integer,
+ * :float, :time or :intern. :time reads the local 'YYYY-MM-DD HH:MM:SS.uuuuuu'
+ * stamps written by rq. :intern is for columns with few distinct values: each
+ * value comes back as one frozen string shared by every row of the statement
+ * (or #exec) that has it. A value that doesn't parse is left as a string, and
+ * decoded columns are not passed through the TypeTranslator. Statements
+ * already compiled pick the change up with their next row. Nil turns
+ * decoding off.
+ */
+static VALUE static_set_column_decoders( VALUE self,
+                                         VALUE decoders )
+{
+  SQLITE_RUBY_DATA *hdb;
+  VALUE normalized = Qnil;
+
+  Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
+  if( hdb->db == NULL )
+    static_raise_db_error( -1, "attempt to access a closed database" );
+
+  if( !NIL_P( decoders ) )
+  {
+    Check_Type( decoders, T_HASH );
+    normalized = rb_hash_new();
+    rb_hash_foreach( decoders, static_add_column_decoder, normalized );
+    rb_obj_freeze( normalized );
+  }
+
+  /* the instance variable keeps the table alive for the handle's sake */
+  rb_iv_set( self, "@column_decoders", normalized );
+  hdb->decoders = normalized;
+
+  return decoders;
+}
+
+/**
+ * Returns the column decoders set by #column_decoders=, or nil.
+ */
+static VALUE static_column_decoders( VALUE self )
+{
+  SQLITE_RUBY_DATA *hdb;
+
+  Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
+
+  return hdb->decoders;
+}
+
+
 /**
  * Interrupts the currently executing query, causing it to abort. If there
  * is no current query, this does nothing.
@@ -670,6 +2145,7 @@ static VALUE static_create_function( VALUE self,
   data = ALLOC( SQLITE_CUSTOM_FUNCTION_CB );
   data->callback = callback;
   data->arg = parm;
+  data->hdb = hdb;
 
   rc = sqlite_create_function( hdb->db,
                                s_name,
@@ -715,6 +2191,7 @@ static VALUE static_create_aggregate( VALUE self,
   data->callback = step;
   data->finalize = finalize;
   data->arg = parm;
+  data->hdb = hdb;
 
   rc = sqlite_create_aggregate( hdb->db,
                                 s_name,
@@ -783,6 +2260,488 @@ static VALUE static_set_type_translation( VALUE self, VALUE value )
   return rb_iv_set( self, "@type_translation", value );
 }
 
+/* fetches the statement wrapped by self, raising if it has been finalized */
+static SQLITE_RUBY_STATEMENT *static_get_statement( VALUE self )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+
+  Data_Get_Struct( self, SQLITE_RUBY_STATEMENT, stmt );
+  if( stmt->vm == NULL )
+    static_raise_db_error( -1, "attempt to access a finalized statement" );
+
+  return stmt;
+}
+
+/* compiles the first SQL statement in the given text, raising on failure */
+static sqlite_vm *static_compile_vm( sqlite *db, const char *sql )
+{
+  sqlite_vm  *vm = NULL;
+  const char *tail = NULL;
+  char       *err = NULL;
+  int         rc;
+
+  rc = sqlite_compile( db, sql, &tail, &vm, &err );
+
+  if( rc != SQLITE_OK )
+  {
+    VALUE v_err = rb_str_new2( err ? err : sqlite_error_string( rc ) );
+    if( err ) free( err );
+    if( vm ) sqlite_finalize( vm, NULL );
+
+    static_raise_db_error( rc, "%s", (const char *)StringValuePtr( v_err ) );
+  }
+
+  if( vm == NULL )
+    static_raise_db_error( -1, "no SQL statement to compile" );
+
+  return vm;
+}
+
+/* resets the virtual machine, returning the result code of its last run */
+static int static_reset_vm( SQLITE_RUBY_STATEMENT *stmt, VALUE *v_err )
+{
+  char *err = NULL;
+  int   rc;
+
+  static_statement_record( stmt );
+
+  rc = sqlite_reset( stmt->vm, &err );
+  stmt->active = 0;
+  stmt->done = 0;
+
+  if( v_err != NULL )
+    *v_err = rb_str_new2( err ? err : sqlite_error_string( rc ) );
+  if( err ) free( err );
+
+  return rc;
+}
+
+/* throws away the virtual machine and compiles the statement again,
+ * restoring the bound values; used when the schema has changed under it */
+static void static_recompile_vm( SQLITE_RUBY_STATEMENT *stmt )
+{
+  long i;
+
+  sqlite_finalize( stmt->vm, NULL );
+  stmt->vm = NULL;
+  stmt->vm = static_compile_vm( stmt->hook.self->db, StringValuePtr( stmt->sql ) );
+  stmt->active = 0;
+  stmt->done = 0;
+  stmt->hook.built_columns = 0;
+  stmt->hook.schema = Qundef;
+
+  for( i = 0; i < RARRAY_LEN( stmt->binds ); i++ )
+  {
+    VALUE value = rb_ary_entry( stmt->binds, i );
+
+    sqlite_bind( stmt->vm, (int)i + 1,
+                 NIL_P( value ) ? NULL : RSTRING_PTR( value ),
+                 NIL_P( value ) ? 0 : (int)RSTRING_LEN( value ) + 1,
+                 1 );
+  }
+}
+
+/**
+ * Compiles the given SQL text into a Statement which may be bound, stepped
+ * and reset any number of times without being parsed again. Only the first
+ * statement in +sql+ is compiled. Placeholders in the SQL are written as '?'.
+ */
+static VALUE static_database_compile( VALUE self,
+                                      VALUE sql )
+{
+  SQLITE_RUBY_DATA *hdb;
+  SQLITE_RUBY_STATEMENT *stmt;
+  sqlite_vm *vm;
+  VALUE v_stmt;
+
+  Check_Type( sql, T_STRING );
+
+  Data_Get_Struct( self, SQLITE_RUBY_DATA, hdb );
+  if( hdb->db == NULL )
+    static_raise_db_error( -1, "attempt to access a closed database" );
+  static_check_owner( hdb );
+  static_busy_reset( hdb );
+
+  vm = static_compile_vm( hdb->db, (const char *)StringValuePtr( sql ) );
+
+  stmt = ALLOC( SQLITE_RUBY_STATEMENT );
+  stmt->vm = vm;
+  stmt->sql = rb_str_new4( sql );
+  stmt->binds = rb_ary_new();
+  stmt->active = 0;
+  stmt->done = 0;
+  stmt->shape = NULL;
+  stmt->usecs = 0;
+  stmt->rows = 0;
+  stmt->timed = 0;
+  stmt->hook.callback = Qnil;
+  stmt->hook.arg = Qnil;
+  stmt->hook.columns = Qnil;
+  stmt->hook.types = Qnil;
+  stmt->hook.fieldset = Qnil;
+  stmt->hook.built_columns = 0;
+  stmt->hook.do_translate = 0;
+  stmt->hook.schema = Qundef;
+  stmt->hook.decoders = Qnil;
+  stmt->hook.interned = Qnil;
+  stmt->hook.stamp_hour[0] = 0;
+  stmt->hook.self = hdb;
+
+  if( static_pragma_enabled( hdb->db, "show_datatypes" ) )
+  {
+    stmt->hook.types = rb_hash_new();
+    stmt->hook.do_translate = ( rb_iv_get( self, "@type_translation" ) == Qtrue );
+  }
+
+  stmt->prev = NULL;
+  stmt->next = hdb->statements;
+  if( hdb->statements != NULL )
+    hdb->statements->prev = stmt;
+  hdb->statements = stmt;
+
+  v_stmt = Data_Wrap_Struct( cSQLiteStatement, static_mark_statement, static_free_statement, stmt );
+  rb_iv_set( v_stmt, "@database", self );
+
+  return v_stmt;
+}
+
+/**
+ * Binds +value+ to the placeholder at +index+ (the left most '?' is 1). A nil
+ * value binds NULL, anything else is bound as its string representation. If
+ * the statement has already been stepped it is reset first. Bound values are
+ * kept across resets.
+ */
+static VALUE static_statement_bind( VALUE self,
+                                    VALUE index,
+                                    VALUE value )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+  int i_index;
+  int rc;
+
+  stmt = static_get_statement( self );
+  static_check_owner( stmt->hook.self );
+  i_index = NUM2INT( index );
+
+  if( !NIL_P( value ) )
+  {
+    value = rb_obj_as_string( value );
+    value = rb_str_new4( value );
+  }
+
+  if( stmt->active )
+    static_reset_vm( stmt, NULL );
+
+  rc = sqlite_bind( stmt->vm, i_index,
+                    NIL_P( value ) ? NULL : RSTRING_PTR( value ),
+                    NIL_P( value ) ? 0 : (int)RSTRING_LEN( value ) + 1,
+                    1 );
+
+  if( rc != SQLITE_OK )
+    static_raise_db_error( rc, "could not bind parameter %d (%s)", i_index, sqlite_error_string( rc ) );
+
+  rb_ary_store( stmt->binds, i_index - 1, value );
+
+  return self;
+}
+
+/**
+ * Executes the statement up to the next row of its result set, which is
+ * returned in the same form #execute would yield it. Returns nil once the
+ * statement has run to completion; it must be reset before it is stepped
+ * again.
+ */
+static VALUE static_statement_step( VALUE self )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+  SQLITE_RUBY_ENGINE_CALL call;
+  struct timeval start;
+  struct timeval end;
+  int rc;
+  VALUE v_err;
+
+  stmt = static_get_statement( self );
+  if( stmt->hook.self == NULL )
+    static_raise_db_error( -1, "attempt to access a closed database" );
+
+  if( stmt->done )
+    return Qnil;
+
+retry:
+  if( g_profiling )
+    gettimeofday( &start, NULL );
+
+  call.vm = stmt->vm;
+  static_run_engine( stmt->hook.self, static_step_without_gvl, &call );
+  rc = call.rc;
+
+  if( g_profiling )
+  {
+    gettimeofday( &end, NULL );
+    stmt->usecs += static_elapsed_usecs( &start, &end );
+    stmt->timed = 1;
+  }
+
+  switch( rc )
+  {
+    case SQLITE_ROW:
+      stmt->active = 1;
+      if( stmt->timed ) stmt->rows++;
+      return static_build_row( &stmt->hook, call.argc, (char **)call.values, (char **)call.columns );
+
+    case SQLITE_DONE:
+      stmt->active = 1;
+      stmt->done = 1;
+      static_statement_record( stmt );
+      return Qnil;
+
+    case SQLITE_BUSY:
+      static_raise_db_error( rc, "%s", sqlite_error_string( rc ) );
+
+    default:
+      /* the real error (and its message) is only reported by a reset */
+      rc = static_reset_vm( stmt, &v_err );
+      static_raise_pending( stmt->hook.self );
+      if( rc == SQLITE_SCHEMA && !stmt->active )
+      {
+        static_recompile_vm( stmt );
+        goto retry;
+      }
+      static_raise_db_error( rc == SQLITE_OK ? SQLITE_ERROR : rc, "%s",
+                             (const char *)StringValuePtr( v_err ) );
+  }
+
+  return Qnil;
+}
+
+/**
+ * Steps the statement up to +size+ times and returns the rows produced as an
+ * array, so that a large result set may be consumed a batch at a time with
+ * one call into the extension per batch. The array is empty once the
+ * statement has run to completion.
+ */
+static VALUE static_statement_step_batch( VALUE self,
+                                          VALUE size )
+{
+  long  n;
+  VALUE rows;
+  VALUE row;
+
+  n = NUM2LONG( size );
+  if( n <= 0 )
+    rb_raise( rb_eArgError, "batch size must be positive" );
+
+  rows = rb_ary_new2( n );
+
+  while( RARRAY_LEN( rows ) < n )
+  {
+    row = static_statement_step( self );
+    if( NIL_P( row ) )
+      break;
+    rb_ary_push( rows, row );
+  }
+
+  return rows;
+}
+
+/**
+ * Resets the statement so that it may be stepped again from the beginning.
+ * Values bound to its placeholders are kept.
+ */
+static VALUE static_statement_reset( VALUE self )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+
+  stmt = static_get_statement( self );
+  if( stmt->hook.self == NULL )
+    static_raise_db_error( -1, "attempt to access a closed database" );
+  static_check_owner( stmt->hook.self );
+
+  static_reset_vm( stmt, NULL );
+
+  return self;
+}
+
+/**
+ * Destroys the compiled statement. Statements still alive when their database
+ * is closed are finalized automatically.
+ */
+static VALUE static_statement_finalize( VALUE self )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+
+  Data_Get_Struct( self, SQLITE_RUBY_STATEMENT, stmt );
+  static_check_owner( stmt->hook.self );
+  static_statement_record( stmt );
+
+  if( stmt->vm != NULL )
+  {
+    sqlite_finalize( stmt->vm, NULL );
+    stmt->vm = NULL;
+  }
+
+  static_unlink_statement( stmt );
+  stmt->hook.self = NULL;
+
+  return Qnil;
+}
+
+/**
+ * Queries whether the statement has been finalized, either explicitly or by
+ * closing its database.
+ */
+static VALUE static_statement_is_closed( VALUE self )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+
+  Data_Get_Struct( self, SQLITE_RUBY_STATEMENT, stmt );
+  return ( stmt->vm == NULL ? Qtrue : Qfalse );
+}
+
+/**
+ * Returns the SQL text the statement was compiled from.
+ */
+static VALUE static_statement_sql( VALUE self )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+
+  Data_Get_Struct( self, SQLITE_RUBY_STATEMENT, stmt );
+  return stmt->sql;
+}
+
+/**
+ * Returns the column names of the result set, or nil if no row has been
+ * stepped yet.
+ */
+static VALUE static_statement_columns( VALUE self )
+{
+  SQLITE_RUBY_STATEMENT *stmt;
+
+  Data_Get_Struct( self, SQLITE_RUBY_STATEMENT, stmt );
+  return stmt->hook.columns;
+}
+
+/* returns the index of the named field of the row, or -1 */
+static long static_row_field_pos( VALUE self, VALUE name )
+{
+  VALUE fieldset;
+  VALUE pos;
+
+  fieldset = rb_ivar_get( self, idIvFieldset );
+  if( NIL_P( fieldset ) )
+    return -1;
+
+  if( SYMBOL_P( name ) )
+    name = rb_str_new2( rb_id2name( SYM2ID( name ) ) );
+
+  pos = rb_hash_aref( rb_ivar_get( fieldset, idIvFieldpos ), name );
+
+  return ( NIL_P( pos ) ? -1 : NUM2LONG( pos ) );
+}
+
+/* gives the row a private copy of its column table with one more field */
+static long static_row_add_field( VALUE self, VALUE name )
+{
+  VALUE fieldset;
+  VALUE fields;
+  VALUE fieldpos;
+  VALUE copy;
+  long  pos;
+
+  fieldset = rb_ivar_get( self, idIvFieldset );
+  if( NIL_P( fieldset ) )
+  {
+    fields = rb_ary_new();
+    fieldpos = rb_hash_new();
+  }
+  else
+  {
+    fields = rb_ary_dup( rb_ivar_get( fieldset, idIvFields ) );
+    fieldpos = rb_funcall( rb_ivar_get( fieldset, idIvFieldpos ), rb_intern( "dup" ), 0 );
+  }
+
+  pos = RARRAY_LEN( fields );
+  rb_ary_push( fields, name );
+  rb_hash_aset( fieldpos, name, LONG2NUM( pos ) );
+
+  copy = rb_obj_alloc( cSQLiteFieldSet );
+  rb_ivar_set( copy, idIvFields, rb_obj_freeze( fields ) );
+  rb_ivar_set( copy, idIvFieldpos, rb_obj_freeze( fieldpos ) );
+  rb_ivar_set( copy, idIvArgument, NIL_P( fieldset ) ? Qnil : rb_ivar_get( fieldset, idIvArgument ) );
+  rb_ivar_set( copy, idIvColumnTypes, NIL_P( fieldset ) ? Qnil : rb_ivar_get( fieldset, idIvColumnTypes ) );
+  rb_ivar_set( self, idIvFieldset, copy );
+
+  return pos;
+}
+
+/* reads one of the shared values out of the row's column table */
+static VALUE static_row_fieldset_ivar( VALUE self, ID id )
+{
+  VALUE fieldset = rb_ivar_get( self, idIvFieldset );
+  return ( NIL_P( fieldset ) ? Qnil : rb_ivar_get( fieldset, id ) );
+}
+
+/**
+ * Returns the column names of the row's result set.
+ */
+static VALUE static_row_fields( VALUE self )
+{
+  return static_row_fieldset_ivar( self, idIvFields );
+}
+
+/**
+ * Returns the application-defined cookie value given to the query.
+ */
+static VALUE static_row_argument( VALUE self )
+{
+  return static_row_fieldset_ivar( self, idIvArgument );
+}
+
+/**
+ * Returns a hash of the column types, keyed by both name and index, or nil
+ * unless the show_datatypes pragma was on for the query.
+ */
+static VALUE static_row_column_types( VALUE self )
+{
+  return static_row_fieldset_ivar( self, idIvColumnTypes );
+}
+
+/**
+ * Element reference. A String or Symbol index is looked up as a column name,
+ * anything else is handled as by Array#[].
+ */
+static VALUE static_row_aref( int argc, VALUE *argv, VALUE self )
+{
+  if( argc == 1 && ( TYPE( argv[0] ) == T_STRING || SYMBOL_P( argv[0] ) ) )
+  {
+    long pos = static_row_field_pos( self, argv[0] );
+    return ( pos < 0 ? Qnil : rb_ary_entry( self, pos ) );
+  }
+
+  return rb_call_super( argc, argv );
+}
+
+/**
+ * Element assignment. A String or Symbol index is looked up as a column name;
+ * assigning to a name the result set does not have adds it as a new field of
+ * this row only. Anything else is handled as by Array#[]=.
+ */
+static VALUE static_row_aset( int argc, VALUE *argv, VALUE self )
+{
+  if( argc == 2 && ( TYPE( argv[0] ) == T_STRING || SYMBOL_P( argv[0] ) ) )
+  {
+    long pos = static_row_field_pos( self, argv[0] );
+
+    if( pos < 0 )
+      pos = static_row_add_field( self, rb_obj_freeze( rb_obj_as_string( argv[0] ) ) );
+
+    rb_ary_store( self, pos, argv[1] );
+    return argv[1];
+  }
+
+  return rb_call_super( argc, argv );
+}
+
 static void static_configure_exception_classes()
 {
   int i;
@@ -806,7 +2765,8 @@ static void static_raise_db_error( int code, const char *msg, ... )
   vsnprintf( message, sizeof( message ), msg, args );
   va_end( args );
 
-  exc = ( code <= 0 ? cSQLiteException : g_sqlite_exceptions[ code ].object );
+  exc = ( code <= 0 || code >= (int)( sizeof( g_sqlite_exceptions ) / sizeof( g_sqlite_exceptions[0] ) ) - 1
+          ? cSQLiteException : g_sqlite_exceptions[ code ].object );
 
   rb_raise( exc, message );
 }
@@ -820,12 +2780,22 @@ void Init__sqlite4rq()
   mSQLite = rb_define_module( "SQLite" );
 
   idCallMethod  = rb_intern( "call" );
-  idInstanceEvalMethod = rb_intern("instance_eval");
   idTranslate = rb_intern("translate");
-  idFields = rb_intern("fields");
-  idFieldsEqual = rb_intern("fields=");
+  idIvFieldset = rb_intern("@fieldset");
+  idIvFields = rb_intern("@fields");
+  idIvFieldpos = rb_intern("@fieldpos");
+  idIvArgument = rb_intern("@argument");
+  idIvColumnTypes = rb_intern("@column_types");
+  idInteger = rb_intern("integer");
+  idFloat = rb_intern("float");
+  idTime = rb_intern("time");
+  idIntern = rb_intern("intern");
   
   cSQLite = rb_define_class_under( mSQLite, "Database", rb_cObject );
+  cSQLiteStatement = rb_define_class_under( mSQLite, "Statement", rb_cObject );
+  cSQLiteRow = rb_define_class_under( mSQLite, "Row", rb_cArray );
+  cSQLiteHashRow = rb_define_class_under( mSQLite, "HashRow", rb_cHash );
+  cSQLiteFieldSet = rb_define_class_under( cSQLiteRow, "FieldSet", rb_cObject );
   cSQLiteException = rb_define_class_under( mSQLite, "DatabaseException", rb_eStandardError );
   cSQLiteQueryContext = rb_define_class_under( mSQLite, "QueryContext", rb_cHash );
   cSQLiteTypeTranslator = rb_define_class_under( mSQLite, "TypeTranslator", rb_cObject );
@@ -834,10 +2804,21 @@ void Init__sqlite4rq()
 
   rb_define_singleton_method( cSQLite, "new", static_database_new, 2 );
 
+  rb_define_module_function( mSQLite, "profiling=", static_set_profiling, 1 );
+  rb_define_module_function( mSQLite, "profiling?", static_is_profiling, 0 );
+  rb_define_module_function( mSQLite, "profile_data", static_profile_data, 0 );
+  rb_define_module_function( mSQLite, "reset_profile", static_reset_profile, 0 );
+
   rb_define_method( cSQLite, "close", static_database_close, 0 );
   rb_define_method( cSQLite, "exec", static_database_exec, 3 );
+  rb_define_method( cSQLite, "insert_many", static_insert_many, 3 );
+  rb_define_method( cSQLite, "busy_timeout=", static_set_busy_timeout, 1 );
+  rb_define_method( cSQLite, "busy_backoff", static_busy_backoff, -1 );
   rb_define_method( cSQLite, "last_insert_rowid", static_last_insert_rowid, 0 );
   rb_define_method( cSQLite, "changes", static_changes, 0 );
+  rb_define_method( cSQLite, "commits", static_commits, 0 );
+  rb_define_method( cSQLite, "column_decoders=", static_set_column_decoders, 1 );
+  rb_define_method( cSQLite, "column_decoders", static_column_decoders, 0 );
   rb_define_method( cSQLite, "interrupt", static_interrupt, 0 );
   rb_define_method( cSQLite, "complete?", static_complete, 1 );
   rb_define_method( cSQLite, "create_function", static_create_function, 4 );
@@ -846,6 +2827,27 @@ void Init__sqlite4rq()
   rb_define_method( cSQLite, "type_translation=", static_set_type_translation, 1 );
   rb_define_method( cSQLite, "use_array=", static_set_use_array, 1 );
   rb_define_method( cSQLite, "use_array?", static_is_use_array, 0 );
+  rb_define_method( cSQLite, "compile", static_database_compile, 1 );
+
+  rb_define_method( cSQLiteRow, "fields", static_row_fields, 0 );
+  rb_define_method( cSQLiteRow, "argument", static_row_argument, 0 );
+  rb_define_method( cSQLiteRow, "column_types", static_row_column_types, 0 );
+  rb_define_method( cSQLiteRow, "[]", static_row_aref, -1 );
+  rb_define_method( cSQLiteRow, "[]=", static_row_aset, -1 );
+
+  rb_define_method( cSQLiteHashRow, "fields", static_row_fields, 0 );
+  rb_define_method( cSQLiteHashRow, "argument", static_row_argument, 0 );
+  rb_define_method( cSQLiteHashRow, "column_types", static_row_column_types, 0 );
+
+  rb_undef_alloc_func( cSQLiteStatement );
+  rb_define_method( cSQLiteStatement, "bind", static_statement_bind, 2 );
+  rb_define_method( cSQLiteStatement, "step", static_statement_step, 0 );
+  rb_define_method( cSQLiteStatement, "step_batch", static_statement_step_batch, 1 );
+  rb_define_method( cSQLiteStatement, "reset", static_statement_reset, 0 );
+  rb_define_method( cSQLiteStatement, "finalize", static_statement_finalize, 0 );
+  rb_define_method( cSQLiteStatement, "closed?", static_statement_is_closed, 0 );
+  rb_define_method( cSQLiteStatement, "sql", static_statement_sql, 0 );
+  rb_define_method( cSQLiteStatement, "columns", static_statement_columns, 0 );
 
   rb_define_const( cSQLite, "VERSION", rb_str_new2( sqlite_libversion() ) );
   rb_define_const( cSQLite, "ENCODING", rb_str_new2( sqlite_libencoding() ) );
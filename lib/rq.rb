@@ -131,6 +131,9 @@ unless defined? $__rq__
     require LIBDIR + 'resubmitter'
     require LIBDIR + 'lister'
     require LIBDIR + 'statuslister'
+    require LIBDIR + 'sqlstatslister'
+    require LIBDIR + 'lockslister'
+    require LIBDIR + 'txstatslister'
     require LIBDIR + 'deleter'
     require LIBDIR + 'updater'
     require LIBDIR + 'querier'
@@ -7,8 +7,9 @@ unless defined? $__rq_configurator__
     require LIBDIR + 'mainhelper'
 
     # 
-    # a Configurator adds key/value pairs to a queue's configuration.  these
-    # key/value pairs are not currently used, but will be in a future release 
+    # a Configurator adds key/value pairs to a queue's configuration.  of these
+    # only 'durability', 'batch_jobs' and 'batch_wait' are used so far (see
+    # QDB::DURABILITIES) and they are checked before being stored
     # 
     class  Configurator < MainHelper
 #--{{{
@@ -17,20 +18,29 @@ unless defined? $__rq_configurator__
 #--{{{
         set_q
         attributes = {}
-        unless @argv.empty?
-          kv_pat = %r/^\s*([^\s]+)\s*=+\s*([^\s]+)\s*$/o
-          @q.transaction do
-            @argv.each do |arg|
-              match = kv_pat.match arg
-              if match 
-                k, v = match[1], match[2] 
-                @q[k] = v
-              end
-            end
-            attributes = @q.attributes
-          end
+        kv_pat = %r/^\s*([^\s]+)\s*=+\s*([^\s]+)\s*$/o
+        kvs = @argv.map{|arg| kv_pat.match arg}.compact.map{|match| [match[1], match[2]]}
+        kvs.each{|k, v| check k, v}
+        @q.transaction('op' => 'configure') do
+          kvs.each{|k, v| @q[k] = v}
+          attributes = @q.attributes
+        end
+        puts attributes.to_yaml
+#--}}}
+      end
+      def check k, v
+#--{{{
+        case k
+          when 'durability'
+            raise "durability <#{ v }> is not one of <#{ QDB::DURABILITIES.keys.sort.join ', ' }>" unless
+              QDB::DURABILITIES.has_key?(v.downcase)
+          when 'batch_jobs'
+            raise "batch_jobs <#{ v }> is not a positive integer" unless
+              (Integer(v) > 0 rescue false)
+          when 'batch_wait'
+            raise "batch_wait <#{ v }> is not a number of seconds" unless
+              (Float(v) >= 0 rescue false)
         end
-        y attributes
 #--}}}
       end
     end # class Configurator
@@ -29,7 +29,7 @@ unless defined? $__rq_executor__
       end
       abort "no sql to execute" if sql.empty?
       @q.qdb.transaction_retries = 0
-      @q.transaction{@q.execute(sql, &dumping_yaml_tuples)}
+      @q.transaction('op' => 'execute'){@q.execute(sql, &dumping_yaml_tuples)}
 #--}}}
     end
 #--}}}
@@ -11,6 +11,7 @@ unless defined? $__rq_feeder__
     require LIBDIR + 'jobrunner'
     require LIBDIR + 'jobrunnerdaemon'
     require LIBDIR + 'jobqueue'
+    require LIBDIR + 'ledger'
 
 
 #
@@ -53,9 +54,18 @@ unless defined? $__rq_feeder__
           @max_sleep = Integer(@options['max_sleep'] || defval('max_sleep'))
           @max_feed = Integer(@options['max_feed'] || defval('feed'))
           @loops = Integer @options['loops'] rescue nil
+          @spool = spool?
+          @spooled = false
+          @ledger = Ledger::new ledger_path
+          @done = @ledger.entries
+          @done_since = (Util::monotonic unless @done.empty?)
+          @spawned = []
+          @unspawned = []
           @children = Hash::new 
           @jrd = JobRunnerDaemon::daemon @q
 
+          SQLite::profiling = profile?
+
           install_signal_handlers
 
           if @daemon and not @quiet
@@ -76,11 +86,15 @@ unless defined? $__rq_feeder__
           debug{ "max_feed <#{ @max_feed }>" }
           debug{ "min_sleep <#{ @min_sleep }>" }
           debug{ "max_sleep <#{ @max_sleep }>" }
+          debug{ "spool <#{ @spool }>" }
+          debug{ "profile <#{ SQLite::profiling? }>" }
+          info{ "<#{ @done.size }> finished jobs replayed from ledger <#{ @ledger.path }>" } unless @done.empty?
 
           transaction do
             fill_morgue
             reap_zombie_ios
           end
+          sweep_staging
 
           looping do
             handle_signal if $rq_signaled
@@ -93,6 +107,8 @@ unless defined? $__rq_feeder__
               end
             end
           end
+
+          flush_done
         end
 #--}}}
       end
@@ -267,6 +283,71 @@ unless defined? $__rq_feeder__
             end
           end
         end
+      #
+      # the dump runs in its own thread since logging takes locks, which may
+      # not be taken from within a trap handler
+      #
+        trap('SIGUSR1') do
+          Thread::new{ dump_sqlstats; dump_lockstats; dump_txstats }
+        end
+#--}}}
+      end
+      def dump_sqlstats
+#--{{{
+        stats = SQLite::profile
+        info{ "sqlstats <#{ stats.size }> statement shapes" }
+        stats.each do |stat|
+          info{ 
+            "sqlstats count=%d total=%.6f mean=%.6f p50=%.6f p99=%.6f rows=%d <%s>" % 
+              stat.values_at(*%w( count total mean p50 p99 rows sql ))
+          }
+        end
+        dump_report sqlstats_path, 'statements' => stats
+      rescue Exception => e # because this is a non-essential function
+        warn{ e }
+#--}}}
+      end
+      def dump_lockstats
+#--{{{
+        stats = @q.lock_stats.report
+        stats.each do |ltype, stat|
+          info{
+            "lockstats %s acquired=%d contended=%d timeouts=%d wait_p99=%.6f hold_p99=%.6f" %
+              [ltype, stat['acquired'], stat['contended'], stat['timeouts'], stat['wait']['p99'], stat['hold']['p99']]
+          }
+        end
+        dump_report lockstats_path, 'locks' => stats
+      rescue Exception => e # because this is a non-essential function
+        warn{ e }
+#--}}}
+      end
+      def dump_txstats
+#--{{{
+        stats = @q.tx_stats.report
+        stats.each do |op, stat|
+          phases = stat['phases'].map{|phase, s| "%s=%.6f/%.6f" % [phase, s['p50'], s['p99']]}
+          info{ "txstats %s count=%d failed=%d p50/p99 %s" % [op, stat['count'], stat['failed'], phases.join(' ')] }
+        end
+        dump_report txstats_path, 'transactions' => stats
+      rescue Exception => e # because this is a non-essential function
+        warn{ e }
+#--}}}
+      end
+    #
+    # writes figures, headed by who dumped them and when, as yaml to path - by
+    # way of a tmp file and a rename so a reader never sees half a report
+    #
+      def dump_report path, figures
+#--{{{
+        report = {
+          'pid' => @pid,
+          'started' => @started,
+          'dumped' => Util::timestamp,
+        }
+        report.update figures
+        tmp = "#{ path }.#{ @pid }.tmp"
+        open(tmp, 'w'){|f| f.write report.to_yaml}
+        File::rename tmp, path
 #--}}}
       end
       def install_redirects
@@ -303,7 +384,7 @@ unless defined? $__rq_feeder__
         begin
           transaction do
             stdin, stdout, stderr, data = @q.stdin, @q.stdout, @q.stderr, @q.data
-            jids = @q.execute("select jid from jobs").map{|tuple| Integer tuple.first}
+            jids = @q.decoding{ @q.execute("select jid from jobs").map{|tuple| tuple.first} }
             jids = jids.inject({}){|h,jid| h.update jid => true}
             %w[ stdin stdout stderr data ].each do |d|
               Dir::glob(File::join(@q.send(d), "*")).each do |iof|
@@ -323,12 +404,30 @@ unless defined? $__rq_feeder__
           warn{ e }
         end
         debug{ "reaped" }
+#--}}}
+      end
+    #
+    # staging needs no lock to sweep (see JobQueue#stage) so it is done outside
+    # any transaction, at start up and then hourly as the feeder relaxes
+    #
+      def sweep_staging
+#--{{{
+        debug{ "sweeping staging" }
+        @swept = Time::now
+        swept = @q.sweep_staging
+        info{ "swept <#{ swept }> staging entries" } if swept > 0
+      rescue Exception => e # because this is a non-essential function
+        warn{ e }
 #--}}}
       end
       def handle_signal
 #--{{{
         if $rq_sigterm or $rq_sigint
           reap_jobs(reap_only = true) until nothing_running? 
+          flush_done
+          dump_sqlstats
+          dump_lockstats
+          dump_txstats
           info{ "** STOPPING **" }
           @jrd.shutdown rescue nil
           @pidfile.posixlock File::LOCK_UN
@@ -337,6 +436,10 @@ unless defined? $__rq_feeder__
 
         if $rq_sighup
           reap_jobs(reap_only = true) until nothing_running? 
+          flush_done
+          dump_sqlstats
+          dump_lockstats
+          dump_txstats
           info{ "** RESTARTING **" }
           info{ "** ARGV <#{ @cmd }> **" }
           begin
@@ -371,33 +474,65 @@ unless defined? $__rq_feeder__
       end
       def start_jobs
 #--{{{
-        debug{ "starting jobs..." }
         n_started = 0 
-        transaction do
-          until busy?
-            break unless((job = @q.getjob))
-            start_job job
-            n_started += 1 
-          end
+        generation = @q.generation
+        if idle_generation? generation
+          debug{ "generation <#{ generation }> unchanged - not polling" }
+          return n_started
         end
+        debug{ "starting jobs..." }
+        claimed = transaction('start_jobs'){ claim_jobs }
+        n_started = spawn_jobs claimed
         debug{ "<#{ n_started }> jobs started" }
+      #
+      # nothing startable was found as of this generation - until another
+      # writer commits there is no point in looking again
+      #
+        @idle_generation = (n_started == 0 ? generation : nil)
+        @polled = Time::now
         n_started
 #--}}}
       end
+    #
+    # starting jobs is done in two steps so that no process is forked while the
+    # queue is locked: claim_jobs marks jobs running for this host inside a
+    # transaction and, once it has committed, spawn_jobs starts them and
+    # records their pids - and gives back any that failed to start - in one
+    # more short transaction.  should the feeder die in between, the claimed
+    # jobs are running on this host by a feeder since gone, which is just what
+    # fill_morgue looks for when the feeder is restarted
+    #
+      def claim_jobs
+#--{{{
+        @q.claim(@max_feed - @children.size)
+#--}}}
+      end
+      def spawn_jobs claimed
+#--{{{
+        started = []
+        claimed.each do |job|
+          if start_job job
+            started << job
+          else
+            @unspawned << job
+          end
+        end
+        @spawned.push(*started)
+        confirm_jobs
+        started.size
+#--}}}
+      end
+      def confirm_jobs
+#--{{{
+        transaction('confirm_jobs'){} unless @spawned.empty? and @unspawned.empty?
+#--}}}
+      end
+    #
+    # job comes from claim_jobs, already marked running so the jobrunner has
+    # its state
+    #
       def start_job job
 #--{{{
-        jid, command = job['jid'], job['command']
-
-      #
-      # we setup state slightly prematurely so jobrunner will have it availible
-      #
-        job['state'] = 'running'
-        job['started'] = Util::timestamp Time::now
-        job['runner'] = Util::hostname 
-
-        job['stdout'] = @q.stdout4 jid
-        job['stderr'] = @q.stderr4 jid
-
         jr = @jrd.runner job
         cid = jr.cid
     
@@ -405,7 +540,6 @@ unless defined? $__rq_feeder__
           jr.run
           job['pid'] = cid
           @children[cid] = job
-          @q.jobisrunning job
           info{ "started - jid <#{ job['jid'] }> pid <#{ job['pid'] }> command <#{ job['command'] }>" }
         else
           error{ "not started - jid <#{ job['jid'] }> command <#{ job['command'] }>" }
@@ -438,7 +572,7 @@ unless defined? $__rq_feeder__
               break if busy?
               cid, status = @jrd.waitpid2 -1, Process::WNOHANG | Process::WUNTRACED 
               break if cid
-              sleep 4.2 
+              sleep 4.2
             end
             cid, status = @jrd.waitpid2 -1, Process::WUNTRACED unless cid
           end
@@ -449,36 +583,130 @@ unless defined? $__rq_feeder__
         if cid and status
           job = @children[cid]
           finish_job job, status
-    
-          transaction do
-            loopno = 0
-            loop do
-              @q.jobisdone job
-              @children.delete cid
-              reaped << cid
-    
-              start_jobs unless reap_only or $rq_signaled
-    
-              if @children.size == 0 or loopno > 42
-                sleep 8 if loopno > 42 # wow - we are CRANKING through jobs so BACK OFF!!
-                break
-              else
-                sleep 0.1
-                cid, status = @jrd.waitpid2 -1, Process::WNOHANG | Process::WUNTRACED 
-                break unless cid and status
-                job = @children[cid]
-                finish_job job, status
-              end
-              loopno += 1
-            end
+        #
+        # spooling, the completions are recorded without the lock - sleeping
+        # between reaps costs no one anything - and the one transaction that
+        # starts more jobs applies them all
+        #
+          if @spool and not reap_only
+            reap_more cid, job, reaped, true
+            start_jobs unless $rq_signaled
+          elsif batching? and not reap_only
+            reap_batched cid, job, reaped
+          else
+        #
+        # otherwise they go in the ledger and the transaction that claims the
+        # jobs taking their place writes them
+        #
+            reap_more cid, job, reaped, false
+            start_jobs unless reap_only or $rq_signaled
           end
         end
         debug{ "<#{ reaped.size }> jobs reaped" }
         reaped
+#--}}}
+      end
+      def reap_more cid, job, reaped, spooling
+#--{{{
+        loopno = 0
+        loop do
+          if spooling
+            @q.spool_jobisdone job
+            @spooled = true
+          else
+            record_done job
+          end
+          @children.delete cid
+          reaped << cid
+
+        #
+        # the ledger costs no one else anything, so whatever has finished is
+        # taken at once and the free slots refilled without a pause
+        #
+          if @children.size == 0 or loopno > 42
+            sleep 8 if loopno > 42 and spooling # wow - we are CRANKING through jobs so BACK OFF!!
+            break
+          else
+            sleep 0.1 if spooling
+            cid, status = @jrd.waitpid2 -1, Process::WNOHANG | Process::WUNTRACED 
+            break unless cid and status
+            job = @children[cid]
+            finish_job job, status
+          end
+          loopno += 1
+        end
+        reaped
+#--}}}
+      end
+    #
+    # with 'batched' durability finished jobs are gathered here, without the
+    # lock, until the batch is due (see batch_due?) and the db hears of them
+    # all in the one transaction that starts the jobs taking their place
+    #
+      def reap_batched cid, job, reaped
+#--{{{
+        status = nil
+        loop do
+          record_done job
+          @children.delete cid
+          reaped << cid
+          break if batch_due? or $rq_signaled
+          loop do
+            sleep 0.1
+            cid, status = @jrd.waitpid2 -1, Process::WNOHANG | Process::WUNTRACED 
+            break if cid and status
+            break if batch_due? or $rq_signaled
+          end
+          break unless cid and status
+          job = @children[cid]
+          finish_job job, status
+        end
+        start_jobs unless $rq_signaled
+        reaped
+#--}}}
+      end
+      def record_done job
+#--{{{
+        @done_since = Util::monotonic if @done.empty?
+        @ledger.append job
+        @done << job
+#--}}}
+      end
+      def batching?
+#--{{{
+        @q.qdb.durability == 'batched'
+#--}}}
+      end
+    #
+    # a batch of finished jobs is written once it holds batch_jobs of them (or
+    # max_feed, if fewer), once the first has waited batch_wait seconds, or
+    # once nothing else is running to join it - which bounds how far the queue
+    # lags behind the ledger.  without 'batched' durability every finished job
+    # is due at once
+    #
+      def batch_due?
+#--{{{
+        return false if @done.empty?
+        return true unless batching?
+        @done.size >= [@q.qdb.batch_jobs, @max_feed].min or batch_left <= 0 or nothing_running?
+#--}}}
+      end
+      def batch_left
+#--{{{
+        @done_since ? @q.qdb.batch_wait - (Util::monotonic - @done_since) : 0
+#--}}}
+      end
+      def flush_done
+#--{{{
+        transaction('reap_jobs'){} unless @done.empty?
 #--}}}
       end
       def finish_job job, status
 #--{{{
+      #
+      # elapsed is taken from the stamp as stored, so that it is exactly
+      # finished - started for anyone reading the row
+      #
         job['finished'] = Util::timestamp(Time::now)
         job['elapsed'] = Util::stamptime(job['finished']) - Util::stamptime(job['started'])
         t = status.exitstatus rescue nil 
@@ -491,7 +719,7 @@ unless defined? $__rq_feeder__
         end
 #--}}}
       end
-      def transaction
+      def transaction op = 'feed'
 #--{{{
         ret = nil
         if @in_transaction
@@ -499,7 +727,17 @@ unless defined? $__rq_feeder__
         else
           begin
             @in_transaction = true
-            @q.transaction{ ret = yield }
+            @q.transaction('op' => op) do
+              @q.jobsaredone @done
+              @q.jobsarerunning @spawned
+              @unspawned.each{|job| @q.unclaim job}
+              ret = yield
+            end
+            @ledger.clear unless @done.empty?
+            @done.clear
+            @spawned.clear
+            @unspawned.clear
+            @spooled = false
           ensure
             @in_transaction = false 
           end
@@ -510,10 +748,28 @@ unless defined? $__rq_feeder__
       def busy?
 #--{{{
         @children.size >= @max_feed
+#--}}}
+      end
+      def idle_generation? generation
+#--{{{
+      #
+      # inside a transaction the lock is already held so polling is free, and
+      # every max_sleep we poll regardless in case something wrote to the db
+      # without going through rq.  records other clients spooled don't bump the
+      # generation, so one readdir of the spool decides whether they are waiting
+      #
+        return false if @in_transaction
+        return false if @spooled
+        return false unless @q.spool.empty?
+        return false if batch_due?
+        return false unless generation and generation == @idle_generation
+        return false unless @polled and (Time::now - @polled) < @max_sleep
+        true
 #--}}}
       end
       def relax
 #--{{{
+        sweep_staging if @swept.nil? or (Time::now - @swept) > 3600
         seconds = rand(@max_sleep - @min_sleep + 1) + @min_sleep
         debug{ "relaxing <#{ seconds }>" }
         sleep seconds
@@ -0,0 +1,62 @@
+unless defined? $__rq_histogram__
+  module RQ
+#--{{{
+    LIBDIR = File::dirname(File::expand_path(__FILE__)) + File::SEPARATOR unless
+      defined? LIBDIR
+
+    #
+    # the Histogram module keeps timings in the log-linear buckets of the
+    # statement profiler (see SQLite.profile), four to an octave of
+    # microseconds, so percentiles cost a fixed 128 counters however many
+    # timings are taken.  LockStats and TxStats mix it in
+    #
+    module Histogram
+#--{{{
+      BUCKETS = 128
+
+      def new_histogram
+#--{{{
+        { 'count' => 0, 'usecs' => 0.0, 'max' => 0.0, 'buckets' => Array::new(BUCKETS, 0) }
+#--}}}
+      end
+      def record histogram, seconds
+#--{{{
+        usecs = seconds * 1e6
+        usecs = 0.0 if usecs < 0
+        histogram['count'] += 1
+        histogram['usecs'] += usecs
+        histogram['max'] = usecs if usecs > histogram['max']
+        histogram['buckets'][bucket(usecs)] += 1
+#--}}}
+      end
+    #
+    # bucket b holds [ 2^(b/4) * (1 + (b%4)/4), 2^(b/4) * (1 + (b%4+1)/4) )
+    # microseconds, as in the extension's statement profiler
+    #
+      def bucket usecs
+#--{{{
+        return 0 if usecs < 1
+        m, exp = Math::frexp usecs
+        b = (exp - 1) * 4 + ((m - 0.5) * 8).to_i
+        b < BUCKETS ? b : BUCKETS - 1
+#--}}}
+      end
+      def summary histogram
+#--{{{
+        count, usecs, buckets = histogram.values_at 'count', 'usecs', 'buckets'
+        {
+          'count' => count,
+          'total' => usecs / 1e6,
+          'mean' => (count > 0 ? usecs / count / 1e6 : 0.0),
+          'p50' => SQLite::profile_percentile(buckets, count, 0.50),
+          'p99' => SQLite::profile_percentile(buckets, count, 0.99),
+          'max' => histogram['max'] / 1e6,
+        }
+#--}}}
+      end
+#--}}}
+    end # module Histogram
+#--}}}
+  end # module RQ
+$__rq_histogram__ = __FILE__
+end
@@ -9,6 +9,7 @@ unless defined? $__rq_jobqueue__
     require LIBDIR + 'util'
     require LIBDIR + 'logging'
     require LIBDIR + 'qdb'
+    require LIBDIR + 'spool'
     require LIBDIR + 'orderedhash'
     require LIBDIR + 'orderedautohash'
 
@@ -22,6 +23,8 @@ unless defined? $__rq_jobqueue__
       class Error < StandardError; end
     
       MAX_JID = 2 ** 20 
+      SPOOL_KEEP = 86400 # secs the name of an applied spool record is kept
+      STAGING_KEEP = 86400 # secs before an abandoned staging entry is swept
     
       class << self
 #--{{{
@@ -38,6 +41,8 @@ unless defined? $__rq_jobqueue__
           FileUtils::mkdir_p q.stdout
           FileUtils::mkdir_p q.stderr
           FileUtils::mkdir_p q.data
+          FileUtils::mkdir_p q.spool.path
+          FileUtils::mkdir_p q.staging
           q
 #--}}}
         end
@@ -50,6 +55,8 @@ unless defined? $__rq_jobqueue__
       attr :stdout
       attr :stderr
       attr :data
+      attr :spool
+      attr :staging
       attr :opts
       attr :qdb
       alias :db :qdb
@@ -62,6 +69,9 @@ unless defined? $__rq_jobqueue__
         @stdout = File::join @path, 'stdout' 
         @stderr = File::join @path, 'stderr' 
         @data = File::join @path, 'data' 
+        @spool = Spool::new File::join(@path, 'spool')
+        @staging = File::join @path, 'staging'
+        @staged = 0
         @opts = opts
         raise "q <#{ @path }> does not exist" unless test ?e, @path
         raise "q <#{ @path }> is not a directory" unless test ?d, @path
@@ -120,80 +130,104 @@ unless defined? $__rq_jobqueue__
         end
 
         now = Util::timestamp Time::now
-    
-        transaction do
-          sql = "select max(jid) from jobs"
-          tuple = execute(sql).first
-          jid = tuple.first || 0
-          jid = Integer(jid) + 1
-
-          jobs.each do |job|
-            command = job['command']
-            stdin = job['stdin']
-            data = job['data']
-
-            raise "no command for job <#{ job.inspect }>" unless command 
-
-            tmp_stdin(stdin) do |ts|
-              tuple = QDB::tuple
-
-              tuple['command']     = command 
-              tuple['priority']    = job['priority'] || 0
-              tuple['tag']         = job['tag']
-              tuple['runner']      = job['runner']
-              tuple['restartable'] = job['restartable']
-              tuple['state']       = 'pending'
-              tuple['submitted']   = now
-              tuple['submitter']   = Util::hostname
-              tuple['stdin']       = stdin4 jid
-              tuple['stdout']      = nil 
-              tuple['stderr']      = nil 
-              tuple['data']       = data4 jid
-
-              values = QDB::q tuple
-
-              sql = "insert into jobs values (#{ values.join ',' });\n"
-              execute(sql){}
+        tuples = nil
+        published = []
 
-              FileUtils::rm_rf standard_in_4(jid)
-              FileUtils::rm_rf standard_out_4(jid)
-              FileUtils::rm_rf standard_err_4(jid)
-              FileUtils::rm_rf data_4(jid)
-              FileUtils::cp ts.path, standard_in_4(jid) if ts
-              if data
-                FileUtils::cp_r data, data_4(jid)
-              else
-                FileUtils::mkdir_p data_4(jid)
-              end
-
-              if block
-                sql = "select * from jobs where jid = '#{ jid }'"
-                execute(sql, &block)
-              end
-            end
-
-            jid += 1
+        staged = stage jobs
+        begin
+          transaction('op' => 'submit') do
+            unpublish published
+            tuples = insert_jobs jobs, now, Util::hostname, staged, published
+          end
+        ensure
+          unstage staged
+        end
+      #
+      # echo what was stored from the tuples at hand, once the lock is released,
+      # rather than selecting every job back out of the db
+      #
+        if block
+          tuples.each do |tuple|
+            row = SQLite::Row.new stored_values(tuple)
+            row.fields = QDB::fields
+            block[row]
           end
         end
     
         self
+#--}}}
+      end
+    #
+    # gives jobs the next free jids and inserts them, within a transaction, and
+    # then puts the files staged for them (see stage) in place.  jobs with
+    # nothing staged - those applied from the spool - get an empty data dir
+    #
+      def insert_jobs jobs, now, submitter = Util::hostname, staged = [], published = []
+#--{{{
+        tuples = []
+        sql = "select max(jid) from jobs"
+        tuple = execute(sql).first
+        jid = tuple.first || 0
+        jid = Integer(jid) + 1
+
+        jobs.each do |job|
+          command = job['command']
+
+          raise "no command for job <#{ job.inspect }>" unless command 
+
+          tuple = QDB::tuple
+
+          tuple['jid']         = jid
+          tuple['command']     = command 
+          tuple['priority']    = job['priority'] || 0
+          tuple['tag']         = job['tag']
+          tuple['runner']      = job['runner']
+          tuple['restartable'] = job['restartable']
+          tuple['state']       = 'pending'
+          tuple['submitted']   = now
+          tuple['submitter']   = submitter
+          tuple['stdin']       = stdin4 jid
+          tuple['stdout']      = nil 
+          tuple['stderr']      = nil 
+          tuple['data']       = data4 jid
+
+          tuples << tuple
+
+          jid += 1
+        end
+      #
+      # one compiled insert, bound and stepped per job
+      #
+        insert_many 'jobs', QDB::fields, tuples.map{|t| stored_values t}
+        tuples.each_with_index{|tuple, i| publish tuple['jid'], staged[i], published}
+        tuples
+#--}}}
+      end
+      def stored_values tuple
+#--{{{
+      #
+      # values as the db hands them back: strings, with empty ones stored NULL
+      #
+        tuple.map{|v| (v.nil? or v.to_s.empty?) ? nil : v.to_s}
 #--}}}
       end
       def resubmit(*jobs, &block)
 #--{{{
         now = Util::timestamp Time::now
+        published = []
 
-        transaction do
-          jobs.each do |job|
-            jid = Integer job['jid']
-            command = job['command']
-            stdin = job['stdin']
-            data = job['data']
+        staged = stage jobs, false
+        begin
+          transaction('op' => 'resubmit') do
+            unpublish published
+            jobs.each_with_index do |job, i|
+              jid = Integer job['jid']
+              command = job['command']
+              data = job['data']
 
-            raise "no jid for job <#{ job.inspect }>" unless jid 
-            raise "no command for job <#{ job.inspect }>" unless command 
+              raise "no jid for job <#{ job.inspect }>" unless jid 
+              raise "no command for job <#{ job.inspect }>" unless command 
 
-            tmp_stdin(stdin) do |ts|
               tuple = QDB::tuple
 
               tuple['jid']         = jid
@@ -215,26 +249,154 @@ unless defined? $__rq_jobqueue__
 
               execute(sql){}
 
-              FileUtils::rm_rf standard_in_4(jid)
-              FileUtils::rm_rf standard_out_4(jid)
-              FileUtils::rm_rf standard_err_4(jid)
-              #FileUtils::rm_rf data_4(jid)
-              FileUtils::cp ts.path, standard_in_4(jid) if ts
-              if data
-                FileUtils::mv data, data_4(jid)
-              else
-                FileUtils::mkdir_p data_4(jid)
-              end
+            #
+            # the data given is moved, not copied - a rename - so it is not staged
+            #
+              FileUtils::mv data, data_4(jid) if data
+              publish jid, staged[i], published
 
               if block
                 sql = "select * from jobs where jid = '#{ jid }'"
                 execute(sql, &block)
               end
-            end # tmp_stdin
-          end # jobs.each
-        end # transaction
+            end # jobs.each
+          end # transaction
+        ensure
+          unstage staged
+        end
     
         self
+#--}}}
+      end
+    #
+    # a job's stdin and data are copied in before the lock is taken: each job
+    # gets a directory under staging holding 'stdin' - empty if it has none -
+    # and, with_data, 'data', a copy of its data or else empty.  insert_jobs
+    # and resubmit then publish them under the jid given, which costs a rename
+    # or two whatever their size, and unstage removes what is left once the
+    # transaction is over.  a staging entry abandoned by a client that died is
+    # removed by sweep_staging
+    #
+      def stage jobs, with_data = true
+#--{{{
+        staged = []
+        begin
+          jobs.each do |job|
+            now = Time::now
+            @staged += 1
+            dir = File::join @staging, "%010d.%06d.%s.%d.%d" % [now.to_i, now.usec, Util::host, $$, @staged]
+            staged << dir
+            FileUtils::mkdir_p dir
+            tmp_stdin(job['stdin']) do |ts|
+              FileUtils::cp ts.path, File::join(dir, 'stdin') if ts
+            end
+            next unless with_data
+            data = File::join dir, 'data'
+            job['data'] ? FileUtils::cp_r(job['data'], data) : FileUtils::mkdir(data)
+          end
+        rescue Exception
+          unstage staged
+          raise
+        end
+        staged
+#--}}}
+      end
+    #
+    # puts what was staged in dir in place for jid, within a transaction, and
+    # removes whatever was left there by an earlier job given the same jid.  a
+    # leftover data dir is renamed into staging for sweep_staging rather than
+    # removed file by file under the lock.  each move is noted in published as
+    # soon as it is made so that unpublish can take back exactly those
+    #
+      def publish jid, dir, published = []
+#--{{{
+        [standard_out_4(jid), standard_err_4(jid)].each do |path|
+          begin
+            File::unlink path
+          rescue Errno::ENOENT
+            nil
+          end
+        end
+        stdin, data = standard_in_4(jid), data_4(jid)
+        unless dir
+          begin
+            File::unlink stdin
+          rescue Errno::ENOENT
+            nil
+          end
+          set_aside data
+          Dir::mkdir data
+          return
+        end
+        entry = [dir, jid, false, false]
+        if test ?e, File::join(dir, 'stdin')
+          File::rename File::join(dir, 'stdin'), stdin
+          entry[2] = true
+        else
+          begin
+            File::unlink stdin
+          rescue Errno::ENOENT
+            nil
+          end
+        end
+        published << entry
+        staged_data = File::join dir, 'data'
+        begin
+          File::rename staged_data, data
+          entry[3] = true
+        rescue Errno::EEXIST, Errno::ENOTEMPTY
+          set_aside data
+          retry
+        rescue Errno::ENOENT
+          Dir::mkdir data unless test ?d, data
+        end
+#--}}}
+      end
+    #
+    # a transaction that is retried first takes back what it published, since
+    # the jids may come out differently the second time
+    #
+      def unpublish published
+#--{{{
+        published.each do |dir, jid, stdin, data|
+          File::rename standard_in_4(jid), File::join(dir, 'stdin') if stdin
+          File::rename data_4(jid), File::join(dir, 'data') if data
+        end
+        published.clear
+      rescue Errno::ENOENT
+        raise Error, "staged files for <#{ published.map{|dir, jid| jid}.join ', ' }> lost when the transaction was retried"
+#--}}}
+      end
+      def set_aside path
+#--{{{
+        now = Time::now
+        @staged += 1
+        aside = File::join @staging, "%010d.%06d.%s.%d.%d.stale" % [now.to_i, now.usec, Util::host, $$, @staged]
+        File::rename path, aside
+      rescue Errno::ENOENT
+        nil
+#--}}}
+      end
+      def unstage staged
+#--{{{
+        staged.each{|dir| FileUtils::rm_rf dir if dir}
+#--}}}
+      end
+    #
+    # removes staging entries older than keep seconds - left by clients that
+    # died mid submit - and the leftovers set aside by publish
+    #
+      def sweep_staging keep = STAGING_KEEP
+#--{{{
+        swept = 0
+        Dir::glob(File::join(@staging, '*')).each do |entry|
+          stale = entry =~ %r/\.stale$/o
+          mtime = (File::lstat(entry).mtime rescue next)
+          next unless stale or (Time::now - mtime) > keep
+          FileUtils::rm_rf entry
+          swept += 1
+        end
+        swept
 #--}}}
       end
       def tmp_stdin stdin = nil
@@ -326,9 +488,9 @@ unless defined? $__rq_jobqueue__
         sql
 
         if block
-          ro_transaction{ execute(sql, &block) }
+          ro_transaction('op' => 'list', 'decoders' => QDB::INTERNED){ cursor(sql, &block) }
         else
-          ret = ro_transaction{ execute(sql) }
+          ret = ro_transaction('op' => 'list', 'decoders' => QDB::INTERNED){ execute(sql) }
         end
 
         ret
@@ -354,7 +516,7 @@ unless defined? $__rq_jobqueue__
         exit_code_map = 
           options[:exit_code_map] || options['exit_code_map'] || {}
 
-        ro_transaction do
+        ro_transaction('op' => 'status', 'decoders' => QDB::DECODERS) do
         #
         # jobs stats
         #
@@ -520,9 +682,9 @@ unless defined? $__rq_jobqueue__
           end
 
         if block
-          ro_transaction{ execute(sql, &block) }
+          ro_transaction('op' => 'query', 'decoders' => QDB::INTERNED){ cursor(sql, &block) }
         else
-          ret = ro_transaction{ execute(sql) }
+          ret = ro_transaction('op' => 'query', 'decoders' => QDB::INTERNED){ execute(sql) }
         end
 
         ret
@@ -594,7 +756,7 @@ unless defined? $__rq_jobqueue__
 
 # TODO - make file deletion transactional too
 
-        transaction do
+        transaction('op' => 'delete') do
           execute(select_sql, &metablock)
           execute(delete_sql){}
         end
@@ -618,27 +780,7 @@ unless defined? $__rq_jobqueue__
       #
         stdin = kvs.delete 'stdin'
         data = kvs.delete 'data'
-      #
-      # validate/munge state value iff present
-      #
-        if((state = kvs['state']))
-          case state
-            when %r/^p/io
-              kvs['state'] = 'pending'
-            when %r/^h/io
-              kvs['state'] = 'holding'
-            else
-              raise "update of <state> = <#{ state }> not allowed (try pending or holding)"
-          end
-        end
-      #
-      # validate kvs pairs
-      #
-        allowed = %w( priority command tag runner restartable )
-        kvs.each do |key, val|
-          raise "update of <#{ key }> = <#{ val }> not allowed" unless
-            (allowed.include?(key)) or (key == 'state' and %w( pending holding ).include?(val))
-        end
+        check_update kvs
       #
       # ensure there are acutally some jobs to update
       #
@@ -702,7 +844,7 @@ unless defined? $__rq_jobqueue__
               lambda{|job| clobber_stdin[job] and clobber_data[job] and tuples << job}
             end
 
-          transaction do 
+          transaction('op' => 'update') do
             update_sql, select_sql = build_sql[kvs, jids]
             break unless select_sql
             execute(update_sql){} if update_sql
@@ -714,49 +856,187 @@ unless defined? $__rq_jobqueue__
 #--}}}
       end
 
-      def getjob
+    #
+    # validates the key=value pairs of an update, munging any state given
+    #
+      def check_update kvs
 #--{{{
-        sql = <<-sql
+      #
+      # validate/munge state value iff present
+      #
+        if((state = kvs['state']))
+          case state
+            when %r/^p/io
+              kvs['state'] = 'pending'
+            when %r/^h/io
+              kvs['state'] = 'holding'
+            else
+              raise "update of <state> = <#{ state }> not allowed (try pending or holding)"
+          end
+        end
+      #
+      # validate kvs pairs
+      #
+        allowed = %w( priority command tag runner restartable )
+        kvs.each do |key, val|
+          raise "update of <#{ key }> = <#{ val }> not allowed" unless
+            (allowed.include?(key)) or (key == 'state' and %w( pending holding ).include?(val))
+        end
+        kvs
+#--}}}
+      end
+
+    #
+    # the 'in' lets sqlite walk the jobs_state index, which it will not do for
+    # an 'or', so finished jobs are never visited.  the order by mixes desc and
+    # asc, which no sqlite 2 index can satisfy, so the candidates are sorted
+    #
+      GETJOB_SQL = 
+#--{{{
+        <<-sql
           select * from jobs 
             where 
-              (state='pending' or (state='dead' and (not restartable isnull))) and 
-              (runner like '%#{ Util::host }%' or runner isnull)
+              state in ('pending', 'dead') and 
+              (state='pending' or (not restartable isnull)) and 
+              (runner like ? or runner isnull)
             order by priority desc, submitted asc, jid asc
             limit 1;
         sql
-        tuples = execute sql
-        job = tuples.first
-        job
 #--}}}
-      end
-      def jobisrunning job 
+    #
+    # sqlite 2 takes no parameter for a limit, so claim fills in the number
+    #
+      CLAIM_SQL = GETJOB_SQL.sub %r/limit 1;/o, 'limit %d;'
+      CLAIMED_SQL = 
 #--{{{
-        sql = <<-sql
+        <<-sql
           update jobs 
             set
-              pid='#{ job['pid'] }',
-              state='#{ job['state'] }',
-              started='#{ job['started'] }',
-              runner='#{ job['runner'] }',
-              stdout='#{ job['stdout'] }',
-              stderr='#{ job['stderr'] }'
-            where jid=#{ job['jid'] };
+              state='running',
+              started=?,
+              runner=?,
+              stdout=? || jid,
+              stderr=? || jid
+            where jid in (%s);
         sql
-        execute sql
 #--}}}
-      end
-      def jobisdone job
+      JOBISRUNNING_SQL = 
 #--{{{
-        sql = <<-sql
+        <<-sql
           update jobs 
             set
-              state = '#{ job['state'] }',
-              exit_status = '#{ job['exit_status'] }',
-              finished = '#{ job['finished'] }',
-              elapsed = '#{ job['elapsed'] }'
-            where jid = #{ job['jid'] };
+              pid=?,
+              state=?,
+              started=?,
+              runner=?,
+              stdout=?,
+              stderr=?
+            where jid=?;
         sql
-        execute sql
+#--}}}
+      JOBISDONE_SQL = 
+#--{{{
+        <<-sql
+          update jobs 
+            set
+              state = ?,
+              exit_status = ?,
+              finished = ?,
+              elapsed = ?
+            where jid = ?;
+        sql
+#--}}}
+    #
+    # values are bound as strings - exactly what the old interpolated sql
+    # stored - so a nil exit_status is still recorded as ''
+    #
+      def getjob
+#--{{{
+        tuples = execute GETJOB_SQL, "%#{ Util::host }%"
+        job = tuples.first
+        job
+#--}}}
+      end
+    #
+    # claims for host up to n of the jobs getjob would return, in the same
+    # order, with one scan and one update: they are marked running, as
+    # start_job expects, in the db and in the tuples returned.  a job that
+    # then fails to start is given back with unclaim, and the pids of those
+    # that do are recorded with jobsarerunning - either perhaps in a later
+    # transaction
+    #
+      def claim n, host = Util::hostname
+#--{{{
+        @claims ||= {}
+        n = Integer n
+        return [] unless n > 0
+        jobs = execute CLAIM_SQL % n, "%#{ host.gsub(%r/\..*$/o, '') }%"
+        return jobs if jobs.empty?
+        started = Util::timestamp Time::now
+        jids = jobs.map{|job| "#{ job['jid'] }"}
+        marks = jids.map{'?'}.join ', '
+        execute CLAIMED_SQL % marks, started, host, stdout4(''), stderr4(''), *jids
+        jobs.each do |job|
+          @claims[job['jid']] = %w( pid state started runner stdout stderr ).map{|f| job[f]}
+          job['state'] = 'running'
+          job['started'] = started
+          job['runner'] = host
+          job['stdout'] = stdout4 job['jid']
+          job['stderr'] = stderr4 job['jid']
+        end
+        jobs
+#--}}}
+      end
+    #
+    # the columns are put back exactly as claim found them - nil as NULL, not
+    # '' - since a runner of '' would match no host again
+    #
+      def unclaim job
+#--{{{
+        binds = (@claims || {}).delete job['jid']
+        execute JOBISRUNNING_SQL, *(binds << "#{ job['jid'] }") if binds
+#--}}}
+      end
+      def jobsarerunning jobs
+#--{{{
+        return if jobs.empty?
+        jobs.each{|job| @claims.delete job['jid']} if @claims
+        whens = jobs.map{'when ? then ?'}.join ' '
+        marks = jobs.map{'?'}.join ', '
+        binds = jobs.map{|job| ["#{ job['jid'] }", "#{ job['pid'] }"]}.flatten
+        binds.push(*jobs.map{|job| "#{ job['jid'] }"})
+        execute "update jobs set pid = case jid #{ whens } end where jid in (#{ marks });", *binds
+#--}}}
+      end
+      def jobisrunning job 
+#--{{{
+        binds = %w( pid state started runner stdout stderr ).map{|f| "#{ job[f] }"}
+        execute JOBISRUNNING_SQL, *(binds << "#{ job['jid'] }")
+#--}}}
+      end
+      def jobisdone job
+#--{{{
+        binds = %w( state exit_status finished elapsed ).map{|f| "#{ job[f] }"}
+        execute JOBISDONE_SQL, *(binds << "#{ job['jid'] }")
+#--}}}
+      end
+    #
+    # records many finished jobs with one update per JOBSAREDONE_CHUNK of them.
+    # only jobs still running are touched, so replaying a feeder's ledger (see
+    # Ledger) after its contents were already committed changes nothing
+    #
+      JOBSAREDONE_CHUNK = 64
+      def jobsaredone jobs
+#--{{{
+        jobs.each_slice(JOBSAREDONE_CHUNK) do |chunk|
+          jids = chunk.map{|job| "#{ job['jid'] }"}
+          whens = chunk.map{'when ? then ?'}.join ' '
+          marks = chunk.map{'?'}.join ', '
+          fields = %w( state exit_status finished elapsed )
+          sets = fields.map{|f| "#{ f } = case jid #{ whens } end"}.join ', '
+          binds = fields.map{|f| chunk.map{|job| ["#{ job['jid'] }", "#{ job[f] }"]}}.flatten
+          execute "update jobs set #{ sets } where jid in (#{ marks }) and state = 'running';", *(binds + jids)
+        end
 #--}}}
       end
       def getdeadjobs(started, &block)
@@ -788,6 +1068,138 @@ unless defined? $__rq_jobqueue__
 #--}}}
       end
 
+    #
+    # the spool lets a client hand a write to the queue without taking the lock:
+    # the intent is recorded in the spool directory and the call returns at
+    # once, and whoever next holds the write lock applies every record waiting
+    # there in the one transaction.  under a burst of submits or completions N
+    # lock handoffs and N synchronous commits become one.  a job with stdin or
+    # data, which must be copied under its jid, cannot be spooled and is
+    # submitted directly
+    #
+    # a spooled submit yields rows whose jid is provisional - the name of the
+    # spool record and the job's place within it - until it has been applied
+    #
+      def spool_submit(*jobs, &block)
+#--{{{
+        if jobs.size == 1 and jobs.first.is_a?(String)
+          jobs = [ { "command" => jobs.join.to_s } ]
+        end
+
+        unless jobs.all?{|job| job['stdin'].to_s.empty? and job['data'].to_s.empty?}
+          return submit(*jobs, &block)
+        end
+
+        payload = 
+          jobs.map do |job|
+            raise "no command for job <#{ job.inspect }>" unless job['command']
+            h = {}
+            %w( command priority tag runner restartable ).each{|f| h[f] = job[f]}
+            h
+          end
+        name = @spool.put 'submit', payload
+        debug{ "spooled <#{ jobs.size }> jobs as <#{ name }>" }
+
+        if block
+          now = Util::timestamp Time::now
+          payload.each_with_index do |job, i|
+            tuple = QDB::tuple
+            job.each{|k,v| tuple[k] = v}
+            tuple['jid'] = "#{ name }/#{ i }"
+            tuple['priority'] ||= 0
+            tuple['state'] = 'pending'
+            tuple['submitted'] = now
+            tuple['submitter'] = Util::hostname
+            row = SQLite::Row.new stored_values(tuple)
+            row.fields = QDB::fields
+            block[row]
+          end
+        end
+
+        self
+#--}}}
+      end
+      def spool_update(kvs, *jids, &block)
+#--{{{
+        if kvs.has_key?('stdin') or kvs.has_key?('data')
+          return update(kvs, *jids, &block)
+        end
+        kvs = check_update kvs.dup
+        raise "no jobs to update" if jids.empty?
+        name = @spool.put 'update', 'kvs' => kvs, 'jids' => jids
+        debug{ "spooled update of <#{ jids.join ',' }> as <#{ name }>" }
+        nil
+#--}}}
+      end
+      def spool_jobisdone job
+#--{{{
+        payload = {}
+        %w( jid state exit_status finished elapsed ).each{|f| payload[f] = job[f]}
+        payload['elapsed'] = Float(payload['elapsed']) rescue nil
+        @spool.put 'jobisdone', payload
+#--}}}
+      end
+    #
+    # applies, within the current write transaction, every spool record waiting
+    # and returns the names of those applied.  the names go into the spooled
+    # table in the same transaction, so a record left behind by a process that
+    # died after committing is only removed, never applied twice.  a record that
+    # cannot be applied is set aside as <name>.failed rather than wedging the
+    # spool
+    #
+      def flush_spool
+#--{{{
+        names = @spool.names
+        return [] if names.empty?
+        if @qdb.schema_version.to_i < 2
+          warn{ "spool not flushed - db schema <#{ @qdb.schema_version }> predates it" }
+          return []
+        end
+        now = Util::timestamp Time::now
+        applied = []
+        names.each do |name|
+          if execute("select count(*) from spooled where name=?", name).first.first.to_i > 0
+            applied << name
+            next
+          end
+          begin
+            record = @spool.load name
+            next unless record
+            apply_spooled name, record
+          rescue SQLite::SQLException, SQLite::ConstraintException, SQLite::MismatchException, 
+                 RuntimeError, ArgumentError, TypeError, NoMethodError => e
+            error{ "spool record <#{ name }> not applied <#{ e.class }: #{ e.message }>" }
+            File::rename File::join(@spool.path, name), File::join(@spool.path, ".#{ name }.failed") rescue nil
+            next
+          end
+          execute "insert into spooled values(?, ?)", name, now
+          applied << name
+        end
+        if @spool_pruned.nil? or (Time::now - @spool_pruned) > 3600
+          execute "delete from spooled where applied < ?", Util::timestamp(Time::now - SPOOL_KEEP)
+          @spool_pruned = Time::now
+        end
+        info{ "applied <#{ applied.size }> spool records" } unless applied.empty?
+        applied
+#--}}}
+      end
+      def apply_spooled name, record
+#--{{{
+        payload = record['payload']
+        case record['kind']
+          when 'submit'
+            tuples = insert_jobs payload, record['time'], record['host']
+            info{ "spooled submit <#{ name }> -> jids <#{ tuples.map{|t| t['jid']}.join ',' }>" }
+          when 'update'
+            update(payload['kvs'], *payload['jids']){}
+          when 'jobisdone'
+            jobisdone payload
+          else
+            raise "unknown kind <#{ record['kind'] }>"
+        end
+#--}}}
+      end
+
       def transaction(*args)
 #--{{{
         raise "cannot upgrade ro_transaction" if @in_ro_transaction
@@ -795,12 +1207,20 @@ unless defined? $__rq_jobqueue__
         if @in_transaction
           ret = yield
         else
+          spooled = []
           begin
             @in_transaction = true
-            @qdb.transaction(*args){ ret = yield }
+            @qdb.transaction(tx_opts(args)) do
+              spooled = flush_spool
+              ret = yield
+            end
           ensure
             @in_transaction = false 
           end
+        #
+        # only once the records are committed may they go
+        #
+          spooled.each{|name| @spool.remove name}
         end
         ret
 #--}}}
@@ -813,17 +1233,72 @@ unless defined? $__rq_jobqueue__
         else
           begin
             @in_ro_transaction = true
-            @qdb.ro_transaction(*args){ ret = yield }
+            @qdb.ro_transaction(tx_opts(args)){ ret = yield }
           ensure
             @in_ro_transaction = false 
           end
         end
         ret
+#--}}}
+      end
+    #
+    # the options of a transaction, which is counted in tx_stats under the op
+    # its caller gives or, failing that, as a plain read or write (see
+    # QDB#transaction)
+    #
+      def tx_opts args
+#--{{{
+        Hash === args.last ? args.last.dup : {}
 #--}}}
       end
       def execute(*args, &block)
 #--{{{
         @qdb.execute(*args, &block)
+#--}}}
+      end
+      def cursor(*args, &block)
+#--{{{
+        @qdb.cursor(*args, &block)
+#--}}}
+      end
+      def insert_many(*args, &block)
+#--{{{
+        @qdb.insert_many(*args, &block)
+#--}}}
+      end
+      def generation(*args, &block)
+#--{{{
+        @qdb.generation(*args, &block)
+#--}}}
+      end
+      def decoding(*args, &block)
+#--{{{
+        @qdb.decoding(*args, &block)
+#--}}}
+      end
+      def disconnect(*args, &block)
+#--{{{
+        @qdb.disconnect(*args, &block)
+#--}}}
+      end
+      def lock_stats(*args, &block)
+#--{{{
+        @qdb.lock_stats(*args, &block)
+#--}}}
+      end
+      def tx_stats(*args, &block)
+#--{{{
+        @qdb.tx_stats(*args, &block)
+#--}}}
+      end
+      def lock_holder(*args, &block)
+#--{{{
+        @qdb.lock_holder(*args, &block)
+#--}}}
+      end
+      def lock_registry_entries(*args, &block)
+#--{{{
+        @qdb.lock_registry_entries(*args, &block)
 #--}}}
       end
       def integrity_check(*args, &block)
@@ -0,0 +1,90 @@
+unless defined? $__rq_ledger__
+  module RQ
+#--{{{
+    LIBDIR = File::dirname(File::expand_path(__FILE__)) + File::SEPARATOR unless
+      defined? LIBDIR
+
+    require 'fileutils'
+
+    #
+    # the Ledger class is a feeder's record of the jobs it has seen finish but
+    # not yet written to the queue.  it is a local file, one line per job,
+    # appended to and fsync'd as each job is reaped, so the feeder need not
+    # hold the queue lock to reap and a crash loses nothing: whatever is in the
+    # ledger when the feeder starts again is written before anything else (see
+    # Feeder#transaction).  the ledger is cleared only once the queue has
+    # committed its contents
+    #
+    class Ledger
+#--{{{
+      FIELDS = %w( jid state exit_status finished elapsed )
+
+      attr :path
+
+      def initialize path
+#--{{{
+        @path = path
+        @file = nil
+#--}}}
+      end
+    #
+    # appends a line for each of jobs and syncs it to disk.  a job is a tuple,
+    # which is an array, so jobs are not flattened
+    #
+      def append *jobs
+#--{{{
+        return self if jobs.empty?
+        f = file
+        jobs.each{|job| f.write(FIELDS.map{|k| "#{ job[k] }".tr("\t\n", '  ')}.join("\t") << "\n")}
+        f.flush
+        f.fsync
+        self
+#--}}}
+      end
+    #
+    # the jobs recorded, as hashes of FIELDS.  a line cut short by a crash is
+    # not a job and is skipped
+    #
+      def entries
+#--{{{
+        IO::read(@path).scan(%r/^[^\n]*\n/o).map do |line|
+          values = line.chomp.split("\t", -1)
+          next unless values.size == FIELDS.size and values.first =~ %r/^\d+$/o
+          Hash[FIELDS.zip(values)]
+        end.compact
+      rescue Errno::ENOENT
+        []
+#--}}}
+      end
+      def empty?
+#--{{{
+        (File::size(@path) rescue 0) == 0
+#--}}}
+      end
+      def clear
+#--{{{
+        f = file
+        f.truncate 0
+        f.fsync
+        self
+#--}}}
+      end
+      def close
+#--{{{
+        @file.close if @file and not @file.closed?
+        @file = nil
+#--}}}
+      end
+      def file
+#--{{{
+        return @file if @file and not @file.closed?
+        FileUtils::mkdir_p File::dirname(@path)
+        @file = open @path, File::CREAT | File::WRONLY | File::APPEND, 0600
+#--}}}
+      end
+#--}}}
+    end # class Ledger
+#--}}}
+  end # module RQ
+$__rq_ledger__ = __FILE__
+end
@@ -0,0 +1,46 @@
+unless defined? $__rq_lockslister__
+  module RQ 
+#--{{{
+    LIBDIR = File::dirname(File::expand_path(__FILE__)) + File::SEPARATOR unless
+      defined? LIBDIR
+
+    require LIBDIR + 'mainhelper'
+
+    #
+    # the LocksLister class dumps a yaml report on stdout of the contention for
+    # a queue's lock: the processes, on any host, holding it or waiting for it
+    # right now and for how long, the pid fcntl reports holding it on this host,
+    # and for each host the figures its feeder keeps on the locks it has taken.
+    # the feeder on this host, if any, is first signaled to write out its
+    # current figures
+    #
+    class  LocksLister < MainHelper
+#--{{{
+      def locks
+#--{{{
+        set_q
+        await_feeder_dump lockstats_path
+
+        now = Time::now
+        report = {}
+        %w( holding waiting ).each{|state| report[state] = []}
+        @q.lock_registry_entries.each do |entry|
+          report[entry['state']] << {
+            'host' => entry['host'],
+            'pid' => entry['pid'],
+            'type' => entry['type'],
+            'since' => Util::timestamp(entry['since']),
+            'seconds' => now - entry['since'],
+          }
+        end
+        report['holder'] = (@q.lock_holder rescue nil)
+        report['hosts'] = lockstats
+        puts report.to_yaml
+#--}}}
+      end
+#--}}}
+    end # class LocksLister
+#--}}}
+  end # module RQ
+$__rq_lockslister__ = __FILE__ 
+end
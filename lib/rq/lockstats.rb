@@ -0,0 +1,120 @@
+unless defined? $__rq_lockstats__
+  module RQ
+#--{{{
+    LIBDIR = File::dirname(File::expand_path(__FILE__)) + File::SEPARATOR unless
+      defined? LIBDIR
+
+    require LIBDIR + 'histogram'
+
+    #
+    # the LockStats class tallies, for one process, how the queue lock has been
+    # come by: for read and write locks alike how many were taken, how many had
+    # to wait and how many waits timed out, the fcntl calls made and refused, a
+    # histogram each of the time spent waiting and the time the lock was held,
+    # and which pids were found holding it when we had to wait
+    #
+    class LockStats
+#--{{{
+      include Histogram
+
+      MAX_HOLDERS = 64
+      TOP_HOLDERS = 8
+
+      def initialize
+#--{{{
+        @types = Hash::new{|h,k| h[k] = new_tally}
+#--}}}
+      end
+      def new_tally
+#--{{{
+        {
+          'acquired' => 0,
+          'contended' => 0,
+          'timeouts' => 0,
+          'attempts' => 0,
+          'refused' => 0,
+          'wait' => new_histogram,
+          'hold' => new_histogram,
+          'holders' => Hash::new(0),
+        }
+#--}}}
+      end
+    #
+    # records one try for a lock of type ltype ('read' or 'write') lasting
+    # seconds.  a contended try, whose first attempt was refused, goes on to
+    # wait: before and after are then File.posixlock_counts either side of the
+    # wait (nil when the extension doesn't keep them) and holder who was seen
+    # in the way, if anyone
+    #
+      def waited ltype, seconds, locked, contended, before = nil, after = nil, holder = nil
+#--{{{
+        t = @types[ltype]
+        attempts, refused, pid = counts_between before, after
+        holder ||= pid if pid and pid > 0 # -1, an ofd lock, names no one
+        t['acquired'] += 1 if locked
+        t['contended'] += 1 if contended
+        t['timeouts'] += 1 unless locked
+        t['attempts'] += 1 + attempts
+        t['refused'] += (contended ? 1 : 0) + refused
+        record t['wait'], seconds
+        if contended and holder
+          holder = holder.to_s
+          holders = t['holders']
+          holders[holder] += 1 if holders.has_key?(holder) or holders.size < MAX_HOLDERS
+        end
+        self
+#--}}}
+      end
+    #
+    # records holding a lock of type ltype for seconds
+    #
+      def held ltype, seconds
+#--{{{
+        record @types[ltype]['hold'], seconds
+        self
+#--}}}
+      end
+      def counts_between before, after
+#--{{{
+        return [0, 0, nil] unless before and after
+        [
+          after[0] - before[0],
+          after[1] - before[1],
+          (after[3] if after[1] > before[1]),
+        ]
+#--}}}
+      end
+    #
+    # a plain hash of the figures, keyed by lock type, fit for yaml
+    #
+      def report
+#--{{{
+        report = {}
+        @types.keys.sort.each do |ltype|
+          t = @types[ltype]
+          top = t['holders'].sort_by{|pid, n| -n}.first(TOP_HOLDERS)
+          report[ltype] = {
+            'acquired' => t['acquired'],
+            'contended' => t['contended'],
+            'timeouts' => t['timeouts'],
+            'attempts' => t['attempts'],
+            'refused' => t['refused'],
+            'wait' => summary(t['wait']),
+            'hold' => summary(t['hold']),
+            'holders' => Hash[top],
+          }
+        end
+        report
+#--}}}
+      end
+      def empty?
+#--{{{
+        @types.empty?
+#--}}}
+      end
+#--}}}
+    end # class LockStats
+#--}}}
+  end # module RQ
+$__rq_lockstats__ = __FILE__
+end
@@ -17,6 +17,8 @@ unless defined? $__rq_mainhelper__
 #--{{{
       include Util
       include Logging
+      DEFAULT_DUMP_WAIT = 5
+
       attr :main
       attr :argv
       attr :env
@@ -55,6 +57,82 @@ unless defined? $__rq_mainhelper__
         @dot_rq_dir = main.dot_rq_dir
         @loops = main.loops
         @q = nil 
+#--}}}
+      end
+      def spool?
+#--{{{
+        @options.has_key?('spool')
+#--}}}
+      end
+      def profile?
+#--{{{
+        @options.has_key?('profile') or not ENV['RQ_PROFILE'].to_s.empty?
+#--}}}
+      end
+      def sqlstats_path host = Util::hostname
+#--{{{
+      #
+      # where a feeder on host keeps its statement profile (see Feeder#dump_sqlstats)
+      #
+        File::join @dot_rq_dir, "sqlstats.#{ host }.yml"
+#--}}}
+      end
+    #
+    # signal the feeder on this host, if any, to dump its figures and give it a
+    # few seconds to rewrite path
+    #
+      def await_feeder_dump path, wait = DEFAULT_DUMP_WAIT
+#--{{{
+        before = (File::stat(path).mtime rescue nil)
+        if @main.signal_feeder('USR1')
+          wait.times do
+            sleep 1
+            mtime = (File::stat(path).mtime rescue nil)
+            break if mtime and mtime != before
+          end
+        end
+#--}}}
+      end
+      def lockstats_path host = Util::hostname
+#--{{{
+      #
+      # where a feeder on host keeps its lock figures (see Feeder#dump_lockstats)
+      #
+        File::join @dot_rq_dir, "lockstats.#{ host }.yml"
+#--}}}
+      end
+      def txstats_path host = Util::hostname
+#--{{{
+      #
+      # where a feeder on host keeps its transaction figures (see Feeder#dump_txstats)
+      #
+        File::join @dot_rq_dir, "txstats.#{ host }.yml"
+#--}}}
+      end
+      def ledger_path host = Util::hostname
+#--{{{
+      #
+      # where a feeder on host notes finished jobs until they are in the queue
+      # (see Ledger)
+      #
+        File::join @dot_rq_dir, "ledger.#{ host }"
+#--}}}
+      end
+      def lockstats
+#--{{{
+      #
+      # the lock figures of every host's feeder, by host
+      #
+        report = {}
+        Dir::glob(lockstats_path('*')).sort.each do |statsfile|
+          host = File::basename(statsfile)[%r/^lockstats\.(.*)\.yml$/, 1]
+          begin
+            report[host] = YAML::load(IO::read(statsfile))
+          rescue => e
+            warn{ "bad lockstats <#{ statsfile }> - #{ e }" }
+          end
+        end
+        report
 #--}}}
       end
       def set_q
@@ -136,9 +214,13 @@ unless defined? $__rq_mainhelper__
       end
       def dumping_yaml_tuples
 #--{{{
+      #
+      # each tuple is rendered into one buffer and written with a single call
+      # so streaming a huge list costs one write per tuple, not one per field
+      #
         fields = nil
         dump = lambda do |tuple|
-          puts '---'
+          STDOUT << "---\n"
           if fields.nil?
             if @fields
               fields = field_match @fields, tuple.fields
@@ -147,8 +229,9 @@ unless defined? $__rq_mainhelper__
             end
           end
           dump = lambda do |tuple|
-            puts '-'
-            fields.each{|f| puts " #{ f }: #{ tuple[ f ] }"}
+            buf = "-\n"
+            fields.each{|f| buf << " #{ f }: #{ tuple[ f ] }\n"}
+            STDOUT << buf
           end
           dump[tuple]
         end
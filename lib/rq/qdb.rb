@@ -5,11 +5,14 @@ unless defined? $__rq_qdb__
       defined? LIBDIR
 
     require 'arrayfields'
+    require 'zlib'
 
     require LIBDIR + 'util'
     require LIBDIR + 'logging'
     require LIBDIR + 'sleepcycle'
     require LIBDIR + 'refresher'
+    require LIBDIR + 'lockstats'
+    require LIBDIR + 'txstats'
 
     #
     # the QDB class is the low level access point to the actual sqlite database.
@@ -59,6 +62,39 @@ unless defined? $__rq_qdb__
           );
         sql
 #--}}}
+    #
+    # changes made to the schema since SCHEMA was frozen, in order.  a queue's
+    # attributes table records the version of the last one applied to it and
+    # the first write transaction to find its queue behind applies the rest,
+    # under the write lock.  a migration that has shipped is never edited or
+    # reordered - a new one is appended
+    #
+      MIGRATIONS = 
+#--{{{
+        [
+        #
+        # claiming a job, counting jobs by state and finding a node's dead jobs
+        # all select on state; without an index each scans every finished job
+        # ever kept
+        #
+          [1, 'index jobs by state', <<-sql],
+            create index jobs_state on jobs(state);
+          sql
+        #
+        # names of the spool records applied, so that one applied by a process
+        # which died before removing it is never applied twice
+        #
+          [2, 'table of applied spool records', <<-sql],
+            create table spooled
+            (
+              name,
+              applied,
+              primary key (name)
+            );
+          sql
+        ]
+#--}}}
+      SCHEMA_VERSION = MIGRATIONS.last.first
     
       DEFAULT_LOGGER                         = Logger::new(STDERR)
       DEFAULT_SQL_DEBUG                      = false
@@ -69,6 +105,59 @@ unless defined? $__rq_qdb__
       DEFAULT_LOCKD_RECOVER_WAIT             = 3600  # 1 hr
       DEFAULT_AQUIRE_LOCK_LOCKFILE_STALE_AGE = 21600 # 6 hrs
       DEFAULT_AQUIRE_LOCK_REFRESH_RATE       = 30
+      DEFAULT_AQUIRE_LOCK_TIMEOUT            = 30     # secs
+      DEFAULT_LOCK_MODE                      = 'auto' # or posix, ofd, flock
+      DEFAULT_LOCK_WRITERS_FIRST             = true
+      DEFAULT_REUSE_CONNECTION               = true
+      DEFAULT_BUSY_TIMEOUT                   = 8.0    # secs
+      DEFAULT_BUSY_BACKOFF_MIN               = 0.0001 # 100 usecs
+      DEFAULT_BUSY_BACKOFF_MAX               = 0.25
+      DEFAULT_DURABILITY                     = 'full'
+      DEFAULT_BATCH_JOBS                     = 8
+      DEFAULT_BATCH_WAIT                     = 1.0    # secs
+
+      WRITE_SQL = %r/^\s*(?:insert|update|delete|replace)\b/io
+
+    #
+    # a queue's durability is set by its 'durability' attribute (see
+    # apply_durability) and decides how hard sqlite syncs each commit.  'full'
+    # fsyncs the journal twice, its directory, and the db; 'normal' fsyncs the
+    # journal once, its directory, and the db - a power cut at just the wrong
+    # moment could then lose the last commit, but not the db.  'batched' syncs
+    # as 'normal' and has feeders put several job state changes in each commit
+    # (see Feeder#batch_due?), losing at most 'batch_jobs' completions of no
+    # more than 'batch_wait' seconds to a crash - jobs a restarted feeder then
+    # finds dead.  'off', which can corrupt the db, is not offered
+    #
+      DURABILITIES = { 'full' => 'FULL', 'normal' => 'NORMAL', 'batched' => 'NORMAL' }
+
+      LOCK_SLOTS     = 512
+      LOCK_SLOT_SIZE = 128
+
+      INTERNED = 
+#--{{{
+        {
+          'state'       => :intern,
+          'runner'      => :intern,
+          'submitter'   => :intern,
+          'tag'         => :intern,
+        }
+#--}}}
+
+      DECODERS = 
+#--{{{
+        {
+          'jid'         => :integer,
+          'pid'         => :integer,
+          'priority'    => :integer,
+          'exit_status' => :integer,
+          'count(*)'    => :integer,
+          'elapsed'     => :float,
+          'submitted'   => :time,
+          'started'     => :time,
+          'finished'    => :time,
+        }.update(INTERNED)
+#--}}}
     
       class << self
 #--{{{
@@ -80,6 +169,13 @@ unless defined? $__rq_qdb__
         attr :lockd_recover_wait, true
         attr :aquire_lock_lockfile_stale_age, true
         attr :aquire_lock_refresh_rate, true
+        attr :aquire_lock_timeout, true
+        attr :lock_mode, true
+        attr :lock_writers_first, true
+        attr :reuse_connection, true
+        attr :busy_timeout, true
+        attr :busy_backoff_min, true
+        attr :busy_backoff_max, true
 
         def fields
 #--{{{
@@ -145,9 +241,10 @@ unless defined? $__rq_qdb__
           qdb = new path, opts
           FileUtils::touch qdb.lockfile
           create_schema qdb.schema
-          qdb.transaction do 
+          qdb.transaction('migrate' => false) do 
             qdb.execute PRAGMAS
             qdb.execute SCHEMA
+            qdb.migrate
           end
           qdb
 #--}}}
@@ -158,6 +255,7 @@ unless defined? $__rq_qdb__
           open(tmp,'w') do |f| 
             f.puts PRAGMAS 
             f.puts SCHEMA
+            MIGRATIONS.each{|version, what, sql| f.puts sql}
           end
           FileUtils::mv tmp, path
 #--}}}
@@ -172,6 +270,14 @@ unless defined? $__rq_qdb__
       attr :fields
       attr :mutex
       attr :lockfile
+      attr :lock_registry
+      attr :generation_path
+      attr :lock_stats
+      attr :tx_stats
+      attr :schema_version
+      attr :durability
+      attr :batch_jobs
+      attr :batch_wait
       attr :sql_debug, true
       attr :transaction_retries, true
       attr :aquire_lock_sc, true
@@ -180,6 +286,13 @@ unless defined? $__rq_qdb__
       attr :lockd_recover_wait, true
       attr :aquire_lock_lockfile_stale_age, true
       attr :aquire_lock_refresh_rate, true
+      attr :aquire_lock_timeout, true
+      attr :lock_mode, true
+      attr :lock_writers_first, true
+      attr :reuse_connection, true
+      attr :busy_timeout, true
+      attr :busy_backoff_min, true
+      attr :busy_backoff_max, true
 
 
       def initialize path, opts = {}
@@ -233,20 +346,68 @@ unless defined? $__rq_qdb__
           klass.aquire_lock_refresh_rate ||
           DEFAULT_AQUIRE_LOCK_REFRESH_RATE
 
+        @aquire_lock_timeout = 
+          Util::getopt('aquire_lock_timeout', @opts) ||
+          klass.aquire_lock_timeout ||
+          DEFAULT_AQUIRE_LOCK_TIMEOUT
+
+        @lock_mode = 
+          Util::getopt('lock_mode', @opts) ||
+          klass.lock_mode ||
+          ENV['RQ_LOCK_MODE'] || 
+          DEFAULT_LOCK_MODE
+
+        @lock_writers_first = 
+          [ Util::getopt('lock_writers_first', @opts), klass.lock_writers_first,
+            ENV['RQ_LOCK_WRITERS_FIRST'], DEFAULT_LOCK_WRITERS_FIRST ].compact.first
+        @lock_writers_first = (@lock_writers_first.to_s !~ %r/^\s*(?:false|no|off|0)\s*$/io)
+
+        @reuse_connection = 
+          [ Util::getopt('reuse_connection', @opts), klass.reuse_connection,
+            ENV['RQ_REUSE_CONNECTION'], DEFAULT_REUSE_CONNECTION ].compact.first
+        @reuse_connection = (@reuse_connection.to_s !~ %r/^\s*(?:false|no|off|0)\s*$/io)
+
+        @busy_timeout = 
+          Util::getopt('busy_timeout', @opts) ||
+          klass.busy_timeout ||
+          DEFAULT_BUSY_TIMEOUT
+
+        @busy_backoff_min = 
+          Util::getopt('busy_backoff_min', @opts) ||
+          klass.busy_backoff_min ||
+          DEFAULT_BUSY_BACKOFF_MIN
+
+        @busy_backoff_max = 
+          Util::getopt('busy_backoff_max', @opts) ||
+          klass.busy_backoff_max ||
+          DEFAULT_BUSY_BACKOFF_MAX
 
         @schema = "#{ @path }.schema"
         @dirname = File::dirname(path).gsub(%r|/+\s*$|,'')
         @basename = File::basename(path)
-        @waiting_w = File::join(@dirname, "#{ Util::hostname }.#{ $$ }.waiting.w") 
-        @waiting_r = File::join(@dirname, "#{ Util::hostname }.#{ $$ }.waiting.r") 
-        @lock_w = File::join(@dirname, "#{ Util::hostname }.#{ $$ }.lock.w") 
-        @lock_r = File::join(@dirname, "#{ Util::hostname }.#{ $$ }.lock.r") 
         @lockfile = File::join(@dirname, 'lock') 
+        @lock_registry = File::join(@dirname, 'lock.registry') 
+        @registry = nil
+        @registry_pid = nil
         @lockf = Lockfile::new("#{ @path }.lock") 
+        @generation_path = File::join(@dirname, 'generation') 
+        @lock_stats = LockStats::new
+        @tx_stats = TxStats::new
+        @tx_phases = nil
+        @dirty = false
         @fields = FIELDS
         @in_transaction = false
         @in_ro_transaction = false
         @db = nil
+        @handle = nil
+        @handle_pid = nil
+        @handle_id = nil
+        @migrated_id = nil
+        @schema_version = nil
+        @durability = nil
+        @batch_jobs = DEFAULT_BATCH_JOBS
+        @batch_wait = DEFAULT_BATCH_WAIT
+        @synchronous = nil
 
         @lockd_recover = "#{ @dirname }.lockd_recover"
         @lockd_recover_lockf = Lockfile::new "#{ @lockd_recover }.lock"
@@ -263,23 +424,47 @@ unless defined? $__rq_qdb__
 #--{{{
         raise 'nested transaction' if @in_transaction
         ro = Util::getopt 'read_only', opts 
+        decoders = Util::getopt 'decoders', opts 
+        migrations = Util::getopt 'migrate', opts, true
+        op = Util::getopt('op', opts) || (ro ? 'read' : 'write')
         ret = nil
         begin 
           @in_transaction = true
+          @tx_phases = Hash::new 0.0
+          started = Util::monotonic
+          failed = true
           lockd_recover_wrap(opts) do
             transaction_wrap(opts) do
               aquire_lock(opts) do
                 #sillyclean(opts) do
                   connect do
-                    execute 'begin' unless ro
-                    ret = yield 
-                    execute 'commit' unless ro
+                    @dirty = false
+                    @db.column_decoders = decoders
+                    phase 'sql' do
+                      apply_durability if migrations and not ro
+                      execute 'begin' unless ro
+                      if migrations and not ro
+                        migrate unless @migrated_id and @migrated_id == @handle_id
+                      end
+                      ret = yield 
+                    end
+                    unless ro
+                      phase 'commit' do
+                        commits = @db.commits
+                        execute 'commit'
+                        bump_generation if @dirty and @db.commits > commits
+                      end
+                    end
                   end
                 #end
               end
             end
           end
+          failed = false
         ensure
+          @tx_phases['total'] = Util::monotonic - started
+          @tx_stats.transacted op, @tx_phases, failed
+          @tx_phases = nil
           @in_transaction = false
         end
         ret
@@ -324,6 +509,21 @@ if false
 #--}}}
       end
 end
+    #
+    # adds the time the block takes to phase name of the current transaction
+    # (see TxStats).  outside a transaction it just yields
+    #
+      def phase name
+#--{{{
+        return yield unless @tx_phases
+        t = Util::monotonic
+        begin
+          yield
+        ensure
+          @tx_phases[name] += Util::monotonic - t if @tx_phases
+        end
+#--}}}
+      end
       def lockd_recover_wrap opts = {}
 #--{{{
         ret = nil
@@ -356,6 +556,7 @@ end
           if try_again
             warn{ "a remote lockd recovery has invalidated this transaction!" }
             warn{ "retrying..."}
+            disconnect
             sleep 120
             retry
           else
@@ -441,14 +642,8 @@ end
 
         @aquire_lock_sc.reset
     
-        waiting, ltype, lfile =
-          if ro
-            [@waiting_r, File::LOCK_SH | File::LOCK_NB, @lock_r]
-          else
-            [@waiting_w, File::LOCK_EX | File::LOCK_NB, @lock_w]
-          end
-    
-        ltype_s = (ltype == File::LOCK_EX ? 'write' : 'read')
+        ltype = (ro ? File::LOCK_SH : File::LOCK_EX) | File::LOCK_NB
+        ltype_s = (ro ? 'read' : 'write')
         ltype ||= File::LOCK_NB
 
         aquired = false
@@ -460,25 +655,26 @@ end
       
             open(@lockfile, 'a+') do |lf|
 
+              lflags = lock_flags
               locked = false
               refresher = nil
               sc = nil
+              held = nil
 
               begin
-                FileUtils::touch waiting
-                # poll
-                42.times do
-                  locked = lf.posixlock(ltype | File::LOCK_NB)
-                  break if locked
-                  sleep rand
-                end
+              #
+              # wait in fcntl, rather than polling, so the lock is granted the
+              # moment it is released.  only once the wait times out do we
+              # check for a stale lockfile and back off
+              #
+                locked = phase('lock'){ take_lock lf, ltype, lflags, ltype_s }
+                held = Time::now
 
                 if locked
                   aquired = true
-                  refresher = Refresher::new @lockfile, @aquire_lock_refresh_rate
-                  debug{ "refresher pid <#{ refresher.pid }> refresh_rate <#{ @aquire_lock_refresh_rate }>" }
-                  FileUtils::rm_f waiting rescue nil
-                  FileUtils::touch lfile rescue nil
+                  register_lock 'holding', ltype_s
+                  refresher = phase('refresher'){ Refresher::new @lockfile, @aquire_lock_refresh_rate }
+                  debug{ "refresher #{ refresher.native? ? 'thread' : 'pid' } <#{ refresher.pid }> refresh_rate <#{ @aquire_lock_refresh_rate }>" }
                   debug{ "aquired lock" }
                   ret = yield
                   debug{ "released lock" }
@@ -499,25 +695,27 @@ end
                   end
                   sc = @aquire_lock_sc.next
                   debug{ "failed to aquire lock - sleep(#{ sc })" }
-                  sleep sc 
+                  phase('lock'){ sleep sc }
                 end
 
               ensure
-                if locked
-                  unlocked = false
-                  begin
-                    42.times do
-                      unlocked = lf.posixlock(File::LOCK_UN | File::LOCK_NB)
-                      break if unlocked
-                      sleep rand
+                phase 'unlock' do
+                  unregister_lock
+                  if locked
+                    unlocked = false
+                    begin
+                      42.times do
+                        unlocked = lf.posixlock(File::LOCK_UN | File::LOCK_NB | lflags)
+                        break if unlocked
+                        sleep rand
+                      end
+                    ensure
+                      lf.posixlock File::LOCK_UN | lflags unless unlocked
                     end
-                  ensure
-                    lf.posixlock File::LOCK_UN unless unlocked
+                    @lock_stats.held ltype_s, Time::now - held
                   end
+                  refresher.kill if refresher
                 end
-                refresher.kill if refresher
-                FileUtils::rm_f waiting rescue nil
-                FileUtils::rm_f lfile rescue nil 
               end
             end
           ensure
@@ -527,43 +725,513 @@ end
         ret
 #--}}}
       end
+    #
+    # takes the lock of ltype on lf, waiting up to aquire_lock_timeout for it,
+    # and records how that went in lock_stats.  with lock_writers_first every
+    # taker, reader or writer, first passes through the intent byte (see
+    # File::LOCK_INTENT) and only holds it until granted the lock proper, so a
+    # writer waiting on readers keeps new readers out and can't be starved by
+    # them, however many there are
+    #
+      def take_lock lf, ltype, lflags, ltype_s
+#--{{{
+        started = Time::now
+        contended = false
+        before = after = holder = nil
+
+        try = lambda do |op|
+          if lf.posixlock(op | File::LOCK_NB | lflags)
+            true
+          else
+            unless contended
+              contended = true
+              holder = lock_registry_holder
+              register_lock 'waiting', ltype_s
+              before = lock_counts
+            end
+            timeout = (@aquire_lock_timeout and
+                       [@aquire_lock_timeout - (Time::now - started), 0].max)
+            lf.posixlock_timeout(op | lflags, timeout)
+          end
+        end
+
+        locked = false
+        if @lock_writers_first and defined? File::LOCK_INTENT
+          if try[File::LOCK_EX | File::LOCK_INTENT]
+            begin
+              locked = try[ltype]
+            ensure
+              lf.posixlock(File::LOCK_UN | File::LOCK_INTENT | lflags) rescue nil
+            end
+          end
+        else
+          locked = try[ltype]
+        end
+
+        after = lock_counts if contended
+        @lock_stats.waited ltype_s, Time::now - started, locked, contended, before, after, holder
+        locked
+#--}}}
+      end
+    #
+    # the kind of lock aquire_lock takes on the lockfile.  open file description
+    # locks conflict with the classic fcntl locks older clients take, so 'ofd'
+    # is always safe, and falls back to 'posix' on kernels without them; 'auto'
+    # is 'ofd'.  flock is cheapest but only excludes other flock users and
+    # doesn't work over nfs, so it is never chosen for you: ask for it, with
+    # lock_mode or RQ_LOCK_MODE, only once every client of a queue on local
+    # disk does the same
+    #
+      def lock_flags
+#--{{{
+        @lock_flags ||=
+          case @lock_mode.to_s
+            when 'posix'
+              0
+            when 'ofd'
+              File::LOCK_OFD
+            when 'flock'
+              File::LOCK_FLOCK
+            else
+              File::LOCK_OFD
+          end
+#--}}}
+      end
+    #
+    # File.posixlock_counts, or nil from an extension that doesn't keep them
+    #
+      def lock_counts
+#--{{{
+        File::posixlock_counts if File::respond_to? :posixlock_counts
+#--}}}
+      end
+    #
+    # the pid holding a lock on the lockfile which would block a write lock, -1
+    # for an open file description lock, or nil if there is none.  only locks
+    # taken on this host are certain to be seen, and flock locks never are
+    #
+      def lock_holder
+#--{{{
+        open(@lockfile, 'a+') do |lf|
+          lf.posixlock_holder(File::LOCK_EX | lock_flags)
+        end
+#--}}}
+      end
+    #
+    # who holds and who waits for the queue lock is kept in lock.registry, a
+    # file of LOCK_SLOTS fixed size slots, one per process (see claim_slot),
+    # which each process pwrites over as it waits, holds and lets go.
+    # that's a write to the page cache rather than a directory entry made and
+    # removed on the server per transaction.  the registry is a file apart from
+    # the lockfile since writes bump the mtime, which is the holder's lease and
+    # mustn't be kept fresh by waiters, and since nfs writes back the dirty
+    # pages of a file whenever it is locked
+    #
+      def register_lock state, ltype_s
+#--{{{
+        io = registry or return
+        claim_slot io if state == 'waiting' or @registry_slot.nil?
+        write_slot io, slot_record(state, ltype_s)
+      rescue => e # because this is a non-essential function
+        debug{ "registering lock - #{ e }" }
+        nil
+#--}}}
+      end
+    #
+    # a process letting go marks its slot idle rather than blank, so that it
+    # stays the process's own between transactions
+    #
+      def unregister_lock
+#--{{{
+        io = registry or return
+        write_slot io, slot_record('idle', '-') if @registry_slot
+      rescue => e # because this is a non-essential function
+        debug{ "unregistering lock - #{ e }" }
+        nil
+#--}}}
+      end
+      def registry
+#--{{{
+        unless @registry_pid == $$
+          @registry.close rescue nil if @registry
+          @registry = nil
+          @registry_pid = $$
+          @registry_slot = nil
+          begin
+            @registry = open(@lock_registry, File::RDWR | File::CREAT, 0666)
+          rescue => e
+            debug{ "no lock registry <#{ @lock_registry }> - #{ e }" }
+          end
+        end
+        @registry
+#--}}}
+      end
+    #
+    # makes sure this process has a slot of its own: the one it had, if it is
+    # still its own, or else the first free one probing on from a slot hashed
+    # from host and pid.  a slot is free when it is blank, belongs to a dead
+    # process on this host, or to one on another host which hasn't written it
+    # in aquire_lock_lockfile_stale_age seconds.  the probe is made holding a
+    # lock on the registry so that two processes don't pick the same slot
+    #
+      def claim_slot io
+#--{{{
+        return @registry_slot if @registry_slot and slot_owner(read_slot(io, @registry_slot)) == [Util::hostname, $$]
+        @registry_slot = nil
+        io.posixlock File::LOCK_EX
+        begin
+          data = (io.sysseek(0) and io.sysread(LOCK_SLOTS * LOCK_SLOT_SIZE) rescue '')
+          start = Zlib::crc32("#{ Util::hostname }.#{ $$ }") % LOCK_SLOTS
+          slot = (0 ... LOCK_SLOTS).map{|i| (start + i) % LOCK_SLOTS}.detect do |s|
+            slot_free? data[s * LOCK_SLOT_SIZE, LOCK_SLOT_SIZE]
+          end
+          raise "lock registry <#{ @lock_registry }> is full" unless slot
+          @registry_slot = slot
+          write_slot io, slot_record('idle', '-')
+        ensure
+          io.posixlock File::LOCK_UN rescue nil
+        end
+        @registry_slot
+#--}}}
+      end
+      def slot_free? record
+#--{{{
+        owner = slot_owner record
+        return true unless owner
+        host, pid = owner
+        return true if host == Util::hostname and (pid == $$ or not process_alive?(pid))
+        since = Float(record.split(%r/\s+/)[3]) rescue 0
+        host != Util::hostname and since < (Time::now.to_f - @aquire_lock_lockfile_stale_age)
+#--}}}
+      end
+    #
+    # [host, pid] of the process a slot belongs to, or nil for a blank one
+    #
+      def slot_owner record
+#--{{{
+        state, type, pid, since, host = record.to_s.strip.split(%r/\s+/, 5)
+        return nil unless host
+        [host, Integer(pid)]
+      rescue ArgumentError, TypeError
+        nil
+#--}}}
+      end
+      def slot_record state, ltype_s
+#--{{{
+        record = "#{ state } #{ ltype_s } #{ $$ } #{ '%.6f' % Time::now.to_f } #{ Util::hostname }"
+        record[0, LOCK_SLOT_SIZE - 1].ljust(LOCK_SLOT_SIZE - 1) << "\n"
+#--}}}
+      end
+      def read_slot io, slot
+#--{{{
+        offset = slot * LOCK_SLOT_SIZE
+        if io.respond_to? :pread
+          io.pread LOCK_SLOT_SIZE, offset
+        else
+          io.sysseek offset
+          io.sysread LOCK_SLOT_SIZE
+        end
+      rescue EOFError
+        nil
+#--}}}
+      end
+      def process_alive? pid
+#--{{{
+        Process::kill 0, pid
+        true
+      rescue Errno::EPERM
+        true
+      rescue
+        false
+#--}}}
+      end
+      def write_slot io, record
+#--{{{
+        offset = @registry_slot * LOCK_SLOT_SIZE
+        if io.respond_to? :pwrite
+          io.pwrite record, offset
+        else
+          io.sysseek offset
+          io.syswrite record
+        end
+#--}}}
+      end
+    #
+    # the holders and waiters of the queue lock on every host, as told by the
+    # registry, oldest first.  each is a hash of the 'host', 'pid', 'type'
+    # (read|write), 'state' (holding|waiting) and 'since' of the entry.
+    # entries of processes on this host which have died are left out
+    #
+      def lock_registry_entries
+#--{{{
+        entries = []
+        data = (IO::read(@lock_registry) rescue nil) or return entries
+        hostname = Util::hostname
+        (0 ... data.size / LOCK_SLOT_SIZE).each do |slot|
+          record = data[slot * LOCK_SLOT_SIZE, LOCK_SLOT_SIZE]
+          state, type, pid, since, host = record.strip.split(%r/\s+/, 5)
+          next unless %w( holding waiting ).include?(state) and host
+          pid = Integer(pid) rescue next
+          next if host == hostname and not process_alive?(pid)
+          entries << {
+            'host' => host,
+            'pid' => pid,
+            'type' => type,
+            'state' => state,
+            'since' => Time::at(Float(since)),
+          }
+        end
+        entries.sort_by{|entry| entry['since']}
+#--}}}
+      end
+    #
+    # 'host.pid' of the longest standing holder of the queue lock, going by the
+    # registry, which unlike fcntl names holders of flock and ofd locks too
+    #
+      def lock_registry_holder
+#--{{{
+        entry = lock_registry_entries.detect{|e| e['state'] == 'holding'}
+        "#{ entry['host'] }.#{ entry['pid'] }" if entry
+      rescue
+        nil
+#--}}}
+      end
+    #
+    # with reuse_connection the handle outlives the transaction, keeping its
+    # parsed schema and its compiled statements.  sqlite drops its page cache
+    # whenever it unlocks the db and checks the schema cookie before every
+    # statement, so another node's commits never make the handle stale - only
+    # the db file being replaced does (see lockd_recover), which a change of
+    # inode after the lock is taken shows.  any error closes the handle, rolling
+    # back whatever the transaction left undone
+    #
       def connect
 #--{{{
         ret = nil
-        opened = nil
+        ok = false
         begin
           raise 'db has no schema' unless test ?e, @schema
+          $db = @db = phase('connect'){ handle }
+          ret = yield @db
+          @db.quiesce if @reuse_connection
+          ok = true
+        ensure
+          $db = @db = nil
+          disconnect unless ok and @reuse_connection
+        end
+        ret
+#--}}}
+      end
+      def handle
+#--{{{
+        disconnect if @handle and (@handle_pid != $$ or @handle_id != db_id)
+        unless @handle
           debug{"connecting to db <#{ @path }>..."}
-          $db = @db = 
+          @handle = 
             begin
               SQLite::Database::new(@path, 0)
             rescue
               SQLite::Database::new(@path)
             end
+          @handle_pid = $$
+          @handle_id = db_id
+          @synchronous = nil
           debug{"connected."}
-          opened = true
-          @db.use_array = true rescue nil
-          ret = yield @db
-        ensure
-          @db.close if opened
-          $db = @db = nil
+          @handle.use_array = true rescue nil
+        #
+        # transient busy conditions are waited out inside the engine, with
+        # backoff, before a BusyException replays the whole transaction
+        #
+          @handle.busy_backoff @busy_timeout, @busy_backoff_min, @busy_backoff_max
+        end
+        @handle
+#--}}}
+      end
+    #
+    # what identifies the db file: replacing it changes this
+    #
+      def db_id
+#--{{{
+        stat = File::stat @path
+        [stat.dev, stat.ino]
+      rescue Errno::ENOENT
+        nil
+#--}}}
+      end
+      def disconnect
+#--{{{
+        if @handle
+          begin
+            @handle.close
+          rescue => e
+            debug{ "closing db <#{ @path }> - #{ e }" }
+          end
+          @handle = nil
           debug{"disconnected from db <#{ @path }>"}
         end
-        ret
+        self
 #--}}}
       end
-      def execute sql, &block
+      def execute sql, *binds, &block
 #--{{{
         raise 'not in transaction' unless @in_transaction
         if @sql_debug
           logger << "SQL:\n#{ sql }\n"
+          logger << "BINDS:\n#{ binds.inspect }\n" unless binds.empty?
         end
+        @dirty = true if sql =~ WRITE_SQL
         #ret = retry_if_locked{ @db.execute sql, &block }
-        ret = @db.execute sql, &block
+        ret =
+          if binds.empty?
+            @db.execute sql, &block
+          else
+          #
+          # statements with bound parameters are compiled once per connection
+          # and then reused from the handle's statement cache
+          #
+            @db.prepare(sql).execute(*binds, &block)
+          end
         if @sql_debug and ret and Array === ret and ret.first
           logger << "RESULT:\n#{ ret.first.inspect }\n...\n"
         end
         ret
+#--}}}
+      end
+      def insert_many table, columns, rows
+#--{{{
+        raise 'not in transaction' unless @in_transaction
+        if @sql_debug
+          logger << "SQL (insert_many):\n#{ table } (#{ columns.join ',' }) x #{ rows.size }\n"
+        end
+        @dirty = true
+        @db.insert_many table, columns, rows
+#--}}}
+      end
+    #
+    # the generation file, beside the db, holds a counter bumped each time a
+    # transaction that wrote to the db commits.  it is only written while the
+    # lock is held, and is replaced by rename so a reader never sees it torn.
+    # an idle client compares it against the value it saw last instead of
+    # taking the lock and opening the db just to find nothing has changed
+    #
+      def generation
+#--{{{
+      #
+      # an open (rather than a bare stat) defeats nfs attribute caching
+      #
+        Integer(IO::read(@generation_path).strip)
+      rescue Errno::ENOENT, ArgumentError
+        nil
+#--}}}
+      end
+      def bump_generation
+#--{{{
+        n = (generation || 0) + 1
+        tmp = "#{ @generation_path }.#{ Util::hostname }.#{ $$ }"
+        begin
+          open(tmp, 'w'){|f| f.puts n}
+          File::rename tmp, @generation_path
+        ensure
+          File::unlink tmp rescue nil
+        end
+        debug{ "generation <#{ n }>" }
+        n
+      rescue => e
+      #
+      # the db has already committed - a missed bump only costs idle clients
+      # a little latency until their next full poll
+      #
+        warn{ "failed to bump generation <#{ e.class }: #{ e.message }>" }
+        nil
+#--}}}
+      end
+    #
+    # brings the schema of the db up to SCHEMA_VERSION, within the current write
+    # transaction.  a migration that fails is logged and left for later rather
+    # than failing the transaction it rides on
+    #
+      def migrate
+#--{{{
+        raise 'not in transaction' unless @in_transaction
+        tuple = execute("select value from attributes where key='schema_version'").first
+        version = Integer(tuple.first) rescue 0
+        MIGRATIONS.each do |v, what, sql|
+          next if v <= version
+          info{ "migrating db <#{ @path }> to schema version <#{ v }> (#{ what })" }
+          begin
+            execute sql
+          rescue => e
+            error{ "migration <#{ v }> failed <#{ e.class }: #{ e.message }>" }
+            break
+          end
+          if tuple
+            execute "update attributes set value='#{ v }' where key='schema_version'"
+          else
+            execute "insert into attributes values('schema_version','#{ v }')"
+            tuple = true
+          end
+          version = v
+        end
+        @migrated_id = @handle_id
+        @schema_version = version
+#--}}}
+      end
+    #
+    # reads the queue's durability attributes and, when they differ from what
+    # the handle was last told, sets its synchronous level to match.  this is
+    # done before each write transaction begins - the level is per connection
+    # and must not change once pages have been journaled
+    #
+      def apply_durability
+#--{{{
+        settings = {}
+        sql = "select key, value from attributes where key in ('durability', 'batch_jobs', 'batch_wait')"
+        execute(sql){|row| settings[row[0]] = row[1]}
+
+        durability = settings['durability'].to_s.strip.downcase
+        durability = DEFAULT_DURABILITY if durability.empty?
+        unless DURABILITIES.has_key? durability
+          warn{ "unknown durability <#{ durability }> - using <#{ DEFAULT_DURABILITY }>" } unless durability == @bad_durability
+          @bad_durability = durability
+          durability = DEFAULT_DURABILITY
+        end
+        @batch_jobs = (Integer(settings['batch_jobs']) rescue DEFAULT_BATCH_JOBS)
+        @batch_wait = (Float(settings['batch_wait']) rescue DEFAULT_BATCH_WAIT)
+
+        synchronous = DURABILITIES[durability]
+        unless @synchronous == synchronous
+          execute "PRAGMA synchronous = #{ synchronous }"
+          debug{ "durability <#{ durability }> synchronous <#{ synchronous }>" }
+          @synchronous = synchronous
+        end
+        @durability = durability
+#--}}}
+      end
+    #
+    # within the block the columns named in decoders come back from the db as
+    # Integer, Float and Time objects, decoded by the extension, rather than
+    # as strings
+    #
+      def decoding decoders = DECODERS
+#--{{{
+        raise 'not in transaction' unless @in_transaction
+        was = @db.column_decoders
+        begin
+          @db.column_decoders = decoders
+          yield
+        ensure
+          @db.column_decoders = was
+        end
+#--}}}
+      end
+      def cursor sql, *binds, &block
+#--{{{
+        raise 'not in transaction' unless @in_transaction
+        if @sql_debug
+          logger << "SQL (cursor):\n#{ sql }\n"
+          logger << "BINDS:\n#{ binds.inspect }\n" unless binds.empty?
+        end
+        @db.cursor sql, *binds, &block
 #--}}}
       end
 #
@@ -612,6 +1280,7 @@ end
 #--{{{
         return nil unless @attempt_lockd_recovery
         warn{ "attempting lockd recovery" }
+        disconnect
         time = Time::now
         ret = nil
 
@@ -12,6 +12,12 @@ unless defined? $__rq_refresher__
     # threads to sleep for some blocking tasks, like fcntl based locks which are
     # used heavily in RQ, resulting in a a prematurely stale lockfile 
     #
+    # where the extension provides File::Lease the touching is done instead by
+    # a native thread, which holds no interpreter lock and so can't be put to
+    # sleep either, and which costs microseconds rather than a fork per
+    # transaction.  setting RQ_FORK_REFRESHER in the environment forces the
+    # old behaviour
+    #
     class Refresher
 #--{{{
       SIGNALS = %w(SIGTERM SIGINT SIGKILL)
@@ -23,6 +29,11 @@ unless defined? $__rq_refresher__
         @path = path
         File::stat path
         @refresh_rate = Float refresh_rate
+        if native?
+          @lease = File::Lease::new @path, @refresh_rate
+          @pid = Process::pid
+          return
+        end
         @pipe = IO::pipe
         if((@pid = Util::fork))
           @pipe.last.close
@@ -47,10 +58,16 @@ unless defined? $__rq_refresher__
             exit!
           end
         end
+#--}}}
+      end
+      def native?
+#--{{{
+        defined?(File::Lease) and not ENV['RQ_FORK_REFRESHER']
 #--}}}
       end
       def kill
 #--{{{
+        return @lease.stop if @lease
         begin
           @thread.kill rescue nil
           @pipe.close rescue nil
@@ -70,7 +70,7 @@ unless defined? $__rq_resubmitter__
         init_job_stdin!
         
         puts '---'
-        @q.transaction do
+        @q.transaction('op' => 'resubmit') do
           jobs = @q.list(*@argv)
           jobs.each do |job|
             job['priority'] = @priority if @options.has_key?('priority')
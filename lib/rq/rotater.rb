@@ -37,7 +37,7 @@ unless defined? $__rq_rotater__
 
         rotq = nil
 
-        @q.transaction do
+        @q.transaction('op' => 'rotate') do
           begin
             #FileUtils::cp_r @qpath, rot
             self.cp_r @qpath, rot
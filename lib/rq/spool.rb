@@ -0,0 +1,96 @@
+unless defined? $__rq_spool__
+  module RQ
+#--{{{
+    LIBDIR = File::dirname(File::expand_path(__FILE__)) + File::SEPARATOR unless
+      defined? LIBDIR
+
+    require LIBDIR + 'util'
+
+    #
+    # the Spool class manages a directory of intent records - writes to the
+    # queue that a client has asked for but not yet made.  a record is a small
+    # yaml file written under a dot name and renamed into place, so a reader
+    # never sees one half written, and is named for the time, host and pid that
+    # made it, so the names sort roughly in the order they were made.  whoever
+    # next holds the write lock applies every record in one transaction (see
+    # JobQueue#flush_spool) and only then removes them
+    #
+    class Spool
+#--{{{
+      include Util
+
+      attr :path
+
+      def initialize path
+#--{{{
+        @path = path
+        @seq = 0
+#--}}}
+      end
+    #
+    # writes a record of kind (submit, jobisdone or update) holding payload and
+    # returns its name
+    #
+      def put kind, payload
+#--{{{
+        now = Time::now
+        @seq += 1
+        name = "%010d.%06d.%s.%d.%d.%s" % [now.to_i, now.usec, Util::host, $$, @seq, kind]
+        record = { 'kind' => kind, 'time' => Util::timestamp(now), 'host' => Util::hostname, 'payload' => payload }
+        tmp = File::join @path, ".#{ name }.tmp"
+        begin
+          begin
+            open(tmp, 'w'){|f| f.write record.to_yaml}
+          rescue Errno::ENOENT
+            raise if test ?d, @path
+            FileUtils::mkdir_p @path
+            retry
+          end
+          File::rename tmp, File::join(@path, name)
+        ensure
+          File::unlink tmp rescue nil
+        end
+        name
+#--}}}
+      end
+    #
+    # names of the records waiting, oldest first
+    #
+      def names
+#--{{{
+        Dir::entries(@path).reject{|e| e =~ %r/^\./o}.sort
+      rescue Errno::ENOENT
+        []
+#--}}}
+      end
+      def size
+#--{{{
+        names.size
+#--}}}
+      end
+      def empty?
+#--{{{
+        names.empty?
+#--}}}
+      end
+      def load name
+#--{{{
+        YAML::load(IO::read(File::join(@path, name)))
+      rescue Errno::ENOENT
+        nil
+#--}}}
+      end
+      def remove name
+#--{{{
+        File::unlink File::join(@path, name)
+        true
+      rescue Errno::ENOENT
+        false
+#--}}}
+      end
+#--}}}
+    end # class Spool
+#--}}}
+  end # module RQ
+$__rq_spool__ = __FILE__
+end
@@ -69,6 +69,95 @@ module SQLite
       end
     end
 
+    # The number of compiled statements kept by #prepare before the least
+    # recently used one is finalized.
+    DEFAULT_STATEMENT_CACHE_SIZE = 32
+
+    # Returns the maximum number of statements kept by the statement cache.
+    def statement_cache_size
+      @statement_cache_size ||= DEFAULT_STATEMENT_CACHE_SIZE
+    end
+
+    # Sets the maximum number of statements kept by the statement cache,
+    # finalizing the least recently used ones if the cache is now too big.
+    def statement_cache_size=( size )
+      @statement_cache_size = Integer( size )
+      trim_statement_cache( @statement_cache_size )
+    end
+
+    # Returns a compiled Statement for the given sql, reusing (and resetting)
+    # a previously compiled one when the same sql was prepared before. The
+    # cache is least-recently-used ordered and bounded by #statement_cache_size.
+    # Statements are finalized when the database is closed.
+    def prepare( sql )
+      cache = ( @statement_cache ||= {} )
+      stmt = cache.delete( sql )
+      if stmt.nil? or stmt.closed?
+        trim_statement_cache( statement_cache_size - 1 )
+        stmt = compile( sql )
+      else
+        stmt.reset
+      end
+      cache[ sql ] = stmt if statement_cache_size > 0
+      stmt
+    end
+
+    # Returns the number of rows a Cursor fetches per call into the extension.
+    def cursor_batch_size
+      @cursor_batch_size ||= Cursor::DEFAULT_BATCH_SIZE
+    end
+
+    # Sets the number of rows a Cursor fetches per call into the extension.
+    def cursor_batch_size=( size )
+      @cursor_batch_size = Integer( size )
+    end
+
+    # Opens a Cursor over the result set of the given sql, with the given values
+    # bound to its placeholders. The cursor compiles its own statement (never a
+    # cached one, so the block may freely use #prepare) and reads the result
+    # #cursor_batch_size rows at a time, so a result set of any size is
+    # streamed in constant memory. If the (optional) block is given it is
+    # executed once for each row and the cursor is closed afterwards.
+    def cursor( sql, *values )
+      cursor = Cursor.new( compile( sql ), cursor_batch_size )
+      cursor.statement.bind_params( *values ) unless values.empty?
+      if block_given?
+        cursor.each { |row| yield row }
+        nil
+      else
+        ( @cursors ||= [] ).delete_if { |c| c.closed? }
+        @cursors.push cursor
+        cursor
+      end
+    end
+
+    # Resets every cached statement and closes any cursor still open, so that
+    # no statement is left part way through its result set holding the
+    # database's read lock. A handle kept open between transactions is
+    # quiesced at the end of each.
+    def quiesce
+      @statement_cache.each_value { |stmt| stmt.reset unless stmt.closed? } if @statement_cache
+      @cursors.each { |c| c.close } if @cursors
+      @cursors = nil
+      self
+    end
+
+    # Finalizes every cached statement.
+    def clear_statement_cache
+      trim_statement_cache( 0 )
+    end
+
+    # Finalizes least recently used statements until at most +size+ remain.
+    def trim_statement_cache( size )
+      return unless @statement_cache
+      while @statement_cache.size > [ size, 0 ].max
+        sql, stmt = @statement_cache.first
+        @statement_cache.delete( sql )
+        stmt.finalize
+      end
+    end
+    private :trim_statement_cache
+
     # A convenience method for retrieving the first row of the result set returned
     # by the given query.
     def get_first_row( sql )
@@ -219,6 +308,225 @@ module SQLite
     define_query_pragma "table_info", "table"
   end
 
+  # A Statement is a compiled SQL statement, created by Database#compile or
+  # taken from the statement cache by Database#prepare. Its '?' placeholders
+  # are bound by position, so values never need quoting into the SQL text.
+  class Statement
+
+    # Returns the database the statement was compiled against.
+    def database
+      @database
+    end
+
+    # Binds each of the given values to the placeholder at the same position.
+    def bind_params( *values )
+      values.flatten.each_with_index { |value, i| bind( i + 1, value ) }
+      self
+    end
+
+    # Resets the statement, binds the given values and runs it to completion.
+    # If the (optional) block is given it is executed once for each row,
+    # otherwise an array of rows is returned. The block may return
+    # SQLite::ABORT to stop early.
+    def execute( *values )
+      reset
+      bind_params( *values ) unless values.empty?
+      if block_given?
+        while ( row = step )
+          break if yield( row ) == SQLite::ABORT
+        end
+        reset
+        nil
+      else
+        rows = []
+        while ( row = step )
+          rows.push row
+        end
+        rows
+      end
+    end
+
+    # Runs the statement with the given values and returns the first row only.
+    def get_first_row( *values )
+      reset
+      bind_params( *values ) unless values.empty?
+      row = step
+      reset
+      row
+    end
+  end
+
+  # A Cursor walks the result set of a statement in batches of rows. It is
+  # Enumerable, and #each or #each_batch without a block return an Enumerator,
+  # so a cursor may also be consumed externally with Enumerator#next. A cursor
+  # can be walked once; its statement is finalized when the walk completes or
+  # is abandoned with break.
+  class Cursor
+    include Enumerable
+
+    # The default number of rows fetched per call into the extension.
+    DEFAULT_BATCH_SIZE = 256
+
+    attr_reader :statement
+    attr_accessor :batch_size
+
+    def initialize( statement, batch_size=DEFAULT_BATCH_SIZE )
+      @statement = statement
+      @batch_size = Integer( batch_size )
+    end
+
+    # Yields each batch (an array of at most #batch_size rows) in turn.
+    def each_batch
+      return enum_for( :each_batch ) unless block_given?
+      return self if closed?
+      begin
+        until ( rows = @statement.step_batch( @batch_size ) ).empty?
+          yield rows
+        end
+      ensure
+        close
+      end
+      self
+    end
+
+    # Yields each row in turn. The block may return SQLite::ABORT to stop early.
+    def each
+      return enum_for( :each ) unless block_given?
+      each_batch do |rows|
+        rows.each do |row|
+          return self if yield( row ) == SQLite::ABORT
+        end
+      end
+      self
+    end
+
+    # Finalizes the statement; further iteration yields nothing.
+    def close
+      @statement.finalize unless @statement.closed?
+      self
+    end
+
+    def closed?
+      @statement.closed?
+    end
+  end
+
+  # The histogram buckets of the statement profiler per power of two of
+  # microseconds (see SQLite.profile_data).
+  PROFILE_BUCKETS_PER_OCTAVE = 4
+
+  # Summarizes the statement profiler's totals (see SQLite.profiling=) as an
+  # array of hashes, one per statement shape, busiest first. Each has the
+  # 'sql' shape, the 'count' of runs, the 'rows' they produced, and their
+  # 'total', 'mean', 'p50' and 'p99' times in seconds. Percentiles are read
+  # off the histogram, so they are good to within a fifth or so.
+  def self.profile
+    profile_data.map do |sql, count, usecs, rows, buckets|
+      {
+        'sql'   => sql,
+        'count' => count,
+        'rows'  => rows,
+        'total' => usecs / 1e6,
+        'mean'  => count > 0 ? usecs / count / 1e6 : 0.0,
+        'p50'   => profile_percentile( buckets, count, 0.50 ),
+        'p99'   => profile_percentile( buckets, count, 0.99 ),
+      }
+    end.sort_by { |stat| -stat['total'] }
+  end
+
+  # The midpoint, in seconds, of the histogram bucket holding percentile +p+.
+  def self.profile_percentile( buckets, count, p )
+    return 0.0 if count == 0
+    rank = ( count * p ).ceil
+    seen = 0
+    buckets.each_with_index do |n, b|
+      seen += n
+      next if seen < rank
+      octave, step = b.divmod( PROFILE_BUCKETS_PER_OCTAVE )
+      lo = ( 2 ** octave ) * ( 1 + step.to_f / PROFILE_BUCKETS_PER_OCTAVE )
+      hi = ( 2 ** octave ) * ( 1 + ( step + 1 ).to_f / PROFILE_BUCKETS_PER_OCTAVE )
+      return b == 0 ? hi / 2e6 : ( lo + hi ) / 2e6
+    end
+    0.0
+  end
+
+  # A Row is a single result row when Database#use_array is set. It is an Array
+  # of the column values which may also be indexed by column name. Every row of
+  # a result set shares one frozen FieldSet (the column names, their indexes,
+  # the column types and the query argument), so building a row costs one
+  # array and no per-row method definitions. Row#[], Row#[]=, #fields,
+  # #argument and #column_types are implemented in the extension.
+  class Row
+
+    # The column table shared by all rows of a result set.
+    class FieldSet
+      attr_reader :fields, :fieldpos, :argument, :column_types
+
+      def initialize( fields, argument=nil, column_types=nil )
+        @fields = fields.map { |f| f.to_s.freeze }.freeze
+        @fieldpos = {}
+        @fields.each_with_index { |f, i| @fieldpos[ f ] = i }
+        @fieldpos.freeze
+        @argument = argument
+        @column_types = column_types
+      end
+
+      # Returns the index of the named field, or nil.
+      def pos( field )
+        @fieldpos[ field.to_s ]
+      end
+    end
+
+    attr_reader :fieldset
+
+    # Replaces the column names of this row only.
+    def fields=( fields )
+      @fieldset = FieldSet.new( fields, argument, column_types )
+    end
+
+    def keys
+      fields
+    end
+
+    def has_key?( key )
+      fields.include?( key.to_s )
+    end
+    alias_method :key?, :has_key?
+    alias_method :member?, :has_key?
+
+    # As Hash#fetch: a column that is present but NULL gives nil, and only a
+    # column the row does not have falls back to the default or block, or
+    # raises.
+    def fetch( key, *default, &block )
+      return super if key.is_a?( Integer )
+      return self[ key ] if has_key?( key )
+      return yield( key ) if block_given?
+      return default.first unless default.empty?
+      raise IndexError, "key not found: #{ key.inspect }"
+    end
+
+    def values_at( *keys )
+      keys.flatten.map { |key| self[ key ] }
+    end
+
+    def each_pair
+      fields.each_with_index { |f, i| yield f, at( i ) }
+    end
+
+    def to_hash
+      h = {}
+      fields.each_with_index { |f, i| h[ f ] = at( i ) }
+      h
+    end
+    alias_method :to_h, :to_hash
+  end
+
+  # A HashRow is a single result row when Database#use_array is not set. It is
+  # keyed by both column name and index.
+  class HashRow
+    attr_reader :fieldset
+  end
+
   # The TypeTranslator is a singleton class that manages the routines that have
   # been registered to convert particular types. The translator only manages
   # conversions in queries (where data is coming out of the database), and not
@@ -0,0 +1,39 @@
+unless defined? $__rq_sqlstatslister__
+  module RQ 
+#--{{{
+    LIBDIR = File::dirname(File::expand_path(__FILE__)) + File::SEPARATOR unless
+      defined? LIBDIR
+
+    require LIBDIR + 'mainhelper'
+
+    #
+    # the SqlStatsLister class dumps a yaml report on stdout of the sql
+    # statements run by the feeders of a queue: for each host, and each
+    # statement shape, the number of runs, the rows returned, and the total,
+    # mean, median and 99th percentile times.  the feeder on this host, if any,
+    # is first signaled to write out its current figures
+    #
+    class  SqlStatsLister < MainHelper
+#--{{{
+      def sqlstats
+#--{{{
+        await_feeder_dump sqlstats_path
+
+        report = {}
+        Dir::glob(sqlstats_path('*')).sort.each do |statsfile|
+          host = File::basename(statsfile)[%r/^sqlstats\.(.*)\.yml$/, 1]
+          begin
+            report[host] = YAML::load(IO::read(statsfile))
+          rescue => e
+            warn{ "bad sqlstats <#{ statsfile }> - #{ e }" }
+          end
+        end
+        puts report.to_yaml
+#--}}}
+      end
+#--}}}
+    end # class SqlStatsLister
+#--}}}
+  end # module RQ
+$__rq_sqlstatslister__ = __FILE__ 
+end
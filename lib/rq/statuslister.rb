@@ -15,13 +15,54 @@ unless defined? $__rq_statuslister__
     # * finished 
     # * dead 
     #
+    # followed by the number of writes waiting in the spool, if any, and a
+    # summary of the contention for the queue lock
+    #
     class  StatusLister < MainHelper
 #--{{{
       def statuslist 
 #--{{{
         set_q
         exit_code_map = parse_exit_code_map @options['exit']
-        puts @q.status('exit_code_map' => exit_code_map).to_yaml
+        stats = @q.status('exit_code_map' => exit_code_map)
+      #
+      # @q is a snapshot of the db alone - the spool and the lock registry are
+      # read from the queue itself
+      #
+        live = JobQueue::new @qpath, 'logger' => @logger
+        spooled = live.spool.size
+        stats['spooled'] = spooled unless spooled == 0
+        stats['locks'] = locks_summary live
+        puts stats.to_yaml
+#--}}}
+      end
+    #
+    # who holds the queue lock and how many wait for it now, and per host the
+    # figures its feeder last dumped (see LocksLister for the full story)
+    #
+      def locks_summary q = @q
+#--{{{
+        entries = q.lock_registry_entries
+        summary = {
+          'holding' => entries.select{|e| e['state'] == 'holding'}.map{|e| "#{ e['host'] }.#{ e['pid'] } (#{ e['type'] })"},
+          'waiting' => entries.select{|e| e['state'] == 'waiting'}.size,
+        }
+        lockstats.each do |host, dump|
+          (dump['locks'] || {}).each do |ltype, stat|
+            (summary['hosts'] ||= {})[host] ||= {}
+            summary['hosts'][host][ltype] = {
+              'acquired' => stat['acquired'],
+              'contended' => stat['contended'],
+              'timeouts' => stat['timeouts'],
+              'wait_p99' => stat['wait']['p99'],
+              'hold_p99' => stat['hold']['p99'],
+            }
+          end
+        end
+        summary
+      rescue => e # because this is a non-essential function
+        warn{ e }
+        nil
 #--}}}
       end
       def parse_exit_code_map emap = 'ok=42'
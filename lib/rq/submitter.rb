@@ -95,10 +95,12 @@ unless defined? $__rq_submitter__
           job['data'] = @data if @data
         end
 
+        how = spool? ? 'spool_submit' : 'submit'
+
         if @options['quiet'] 
-          @q.submit(*jobs)
+          @q.send(how, *jobs)
         else
-          @q.submit(*jobs, &dumping_yaml_tuples)
+          @q.send(how, *jobs, &dumping_yaml_tuples)
         end
     
         jobs = nil
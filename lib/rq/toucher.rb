@@ -142,7 +142,7 @@ unless defined? $__rq_toucher__
       #
       # update or submit
       #
-        @q.transaction do
+        @q.transaction('op' => 'touch') do
           pending = @q.list 'pending'
 
           pjobs, pcommands = {}, {}
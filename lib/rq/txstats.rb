@@ -0,0 +1,84 @@
+unless defined? $__rq_txstats__
+  module RQ
+#--{{{
+    LIBDIR = File::dirname(File::expand_path(__FILE__)) + File::SEPARATOR unless
+      defined? LIBDIR
+
+    require LIBDIR + 'histogram'
+
+    #
+    # the TxStats class tallies, for one process, where the time of its
+    # transactions goes.  each is split into phases - waiting for the lock,
+    # starting the lockfile refresher, connecting to the db, running the sql,
+    # committing, and unlocking - and for every kind of operation (submit,
+    # start_jobs, status ...) a histogram is kept of each phase and of the
+    # whole.  comparing them shows whether nfs locking, sqlite i/o or ruby is
+    # what a cluster is waiting on
+    #
+    class TxStats
+#--{{{
+      include Histogram
+
+      PHASES = %w( lock refresher connect sql commit unlock total )
+      MAX_OPS = 64
+
+      def initialize
+#--{{{
+        @ops = Hash::new{|h,k| h[k] = new_tally}
+#--}}}
+      end
+      def new_tally
+#--{{{
+        phases = {}
+        PHASES.each{|phase| phases[phase] = new_histogram}
+        { 'count' => 0, 'failed' => 0, 'phases' => phases }
+#--}}}
+      end
+    #
+    # records one transaction of op, phases mapping each phase it went through
+    # to the seconds spent there.  failed is true when it raised or was
+    # abandoned rather than committed
+    #
+      def transacted op, phases, failed = false
+#--{{{
+        op = 'other' unless @ops.has_key?(op) or @ops.size < MAX_OPS
+        t = @ops[op]
+        t['count'] += 1
+        t['failed'] += 1 if failed
+        phases.each do |phase, seconds|
+          histogram = t['phases'][phase]
+          record histogram, seconds if histogram
+        end
+        self
+#--}}}
+      end
+    #
+    # a plain hash of the figures, keyed by op, fit for yaml.  phases an op
+    # never went through (a read commits nothing) are left out
+    #
+      def report
+#--{{{
+        report = {}
+        @ops.keys.sort.each do |op|
+          t = @ops[op]
+          phases = {}
+          PHASES.each do |phase|
+            histogram = t['phases'][phase]
+            phases[phase] = summary(histogram) unless histogram['count'] == 0
+          end
+          report[op] = { 'count' => t['count'], 'failed' => t['failed'], 'phases' => phases }
+        end
+        report
+#--}}}
+      end
+      def empty?
+#--{{{
+        @ops.empty?
+#--}}}
+      end
+#--}}}
+    end # class TxStats
+#--}}}
+  end # module RQ
+$__rq_txstats__ = __FILE__
+end
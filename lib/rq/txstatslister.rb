@@ -0,0 +1,39 @@
+unless defined? $__rq_txstatslister__
+  module RQ 
+#--{{{
+    LIBDIR = File::dirname(File::expand_path(__FILE__)) + File::SEPARATOR unless
+      defined? LIBDIR
+
+    require LIBDIR + 'mainhelper'
+
+    #
+    # the TxStatsLister class dumps a yaml report on stdout of where the time
+    # of the transactions run by the feeders of a queue goes: for each host,
+    # and each kind of operation, the number run and failed and the total,
+    # mean, median, 99th percentile and worst times of each phase.  the feeder
+    # on this host, if any, is first signaled to write out its current figures
+    #
+    class  TxStatsLister < MainHelper
+#--{{{
+      def txstats
+#--{{{
+        await_feeder_dump txstats_path
+
+        report = {}
+        Dir::glob(txstats_path('*')).sort.each do |statsfile|
+          host = File::basename(statsfile)[%r/^txstats\.(.*)\.yml$/, 1]
+          begin
+            report[host] = YAML::load(IO::read(statsfile))
+          rescue => e
+            warn{ "bad txstats <#{ statsfile }> - #{ e }" }
+          end
+        end
+        puts report.to_yaml
+#--}}}
+      end
+#--}}}
+    end # class TxStatsLister
+#--}}}
+  end # module RQ
+$__rq_txstatslister__ = __FILE__ 
+end
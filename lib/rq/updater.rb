@@ -79,7 +79,9 @@ unless defined? $__rq_updater__
       #
       # apply the update
       #
-        if @options['quiet'] 
+        if spool?
+          @q.spool_update(kvs,*jids)
+        elsif @options['quiet'] 
           @q.update(kvs,*jids)
         else
           @q.update(kvs,*jids, &dumping_yaml_tuples)
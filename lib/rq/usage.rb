@@ -337,7 +337,22 @@ MODES
     be used as well) and all three will be stored in a directory relative the
     the queue itself.  the stdin/stdout/stderr files are stored by job id and
     there location (though relative to the queue) is shown in the output of
-    'list' (see docs for list).
+    'list' (see docs for list).  a job's stdin and data are first copied into
+    the queue's 'staging' directory, before the queue is locked, and renamed
+    into place once the job has its id, so a large stdin or data dir does not
+    hold up other nodes.  a feeder removes staging left by a submit that died.
+
+    with the '--spool' option submit does not wait for the queue's lock.  the
+    jobs are written to a file in the queue's 'spool' directory and rq returns
+    at once, echoing each job with a provisional jid naming that file.  the
+    next process to take the lock for writing - a feeder, or any submit
+    without '--spool' - gives the jobs real jids and stores them, together with
+    everything else spooled meanwhile, in a single transaction.  when many
+    processes submit at once this is far cheaper than each taking the lock in
+    turn.  jobs with stdin or data are always submitted directly.  update and
+    feed take '--spool' too: an update is then applied later in the same way,
+    and a feeder records the jobs it finishes in the spool and applies them
+    when it next starts jobs.  status shows how many spool files are waiting.
       
 
     examples :
@@ -403,6 +418,10 @@ MODES
 
         ~ > rq q s --stage wont_run_yet
 
+      10) submit a job from a cluster script without waiting on the lock
+
+        ~ > rq q s --spool job.sh
+
 
   resubmit, r :
 
@@ -527,6 +546,77 @@ MODES
         ~ > rq q t --exit 'ok=42,43 command_not_found=127'
 
 
+  sqlstats :
+
+    feeders started with '--profile', or with RQ_PROFILE set in their
+    environment, time every sql statement they run against the queue's db.
+    statements are grouped by shape - the sql with its literal values replaced
+    by '?' - and for each shape the number of runs, the rows returned, and the
+    total, mean, median (p50) and 99th percentile (p99) times in seconds are
+    kept.  a feeder writes these figures to ~/.rq/ (see '--dot_rq_dir') and
+    its log when it is sent SIGUSR1, and again when it stops or restarts.
+
+    sqlstats mode signals the feeder on this host, if any, to write out its
+    figures and then shows those of every host's feeder, busiest statements
+    first.  there are no 'mode_args'.
+
+    examples :
+
+      0) show which statements are costing q's feeders the most time
+
+        ~ > rq q start --profile
+        ~ > rq q sqlstats
+
+      1) have a feeder log its figures without stopping it
+
+        ~ > kill -USR1 $(rq q pid | awk '/pid/{print $3}')
+
+
+  locks :
+
+    shows who is contending for the queue's lock.  'holding' and 'waiting'
+    list the processes, on every host, that hold the lock or wait for it now,
+    with the lock type and how many seconds they have done so.  'holder' is
+    the pid fcntl reports holding a conflicting lock on this host (-1 for an
+    open file description lock, nothing for flock).  'hosts' gives, for each
+    host's feeder, the read and write locks it acquired, how many of those
+    had to wait ('contended') or gave up waiting ('timeouts'), the fcntl
+    calls made and refused, the total, mean, p50, p99 and max seconds spent
+    waiting for and holding the lock, and the pids most often found holding
+    it.  like sqlstats, the feeder writes these figures to ~/.rq/ on SIGUSR1
+    and when it stops or restarts, and locks mode signals the feeder on this
+    host first.  status mode shows a summary of the same.  there are no
+    'mode_args'.
+
+    examples :
+
+      0) see why q is slow
+
+        ~ > rq q locks
+
+
+  txstats :
+
+    shows where the time of the feeders' transactions goes.  every
+    transaction is split into phases: 'lock' (waiting for the queue's lock),
+    'refresher' (starting the lockfile refresher), 'connect' (opening the db),
+    'sql' (the statements themselves), 'commit' (the commit, and its fsync),
+    'unlock' (giving the lock up) and 'total'.  for each host's feeder and
+    each kind of transaction - start_jobs, reap_jobs and so on - the number
+    run and failed and the total, mean, p50, p99 and max seconds of each phase
+    are kept.  a lock phase that dominates points at nfs locking, commit at
+    the i/o beneath sqlite, and a total well above the sum of its phases at
+    ruby itself.  like sqlstats, the feeder writes these figures to ~/.rq/ and
+    its log on SIGUSR1 and when it stops or restarts, and txstats mode signals
+    the feeder on this host first.  there are no 'mode_args'.
+
+    examples :
+
+      0) see whether q's feeders are waiting on the lock or the disk
+
+        ~ > rq q txstats
+
+
   delete, d :
 
     delete combinations of pending, holding, finished, dead, or jobs specified
@@ -727,7 +817,36 @@ MODES
 
   configure, C :
 
-    this mode is not supported yet.
+    sets key=value pairs in the queue's configuration, which is kept in the
+    db and so shared by every node.  the keys understood are
+
+      durability : full | normal | batched (default full)
+
+        how hard the db is synced to disk on each commit.  'full' is the
+        safest and slowest.  'normal' skips one of the journal's fsyncs; a
+        power cut at just the wrong moment could cost the last commit but
+        cannot corrupt the db.  'batched' syncs as 'normal' and, in addition,
+        has feeders hold finished jobs back until several can be recorded -
+        and the jobs taking their place started - in a single commit.  the
+        jobs held back are kept in the feeder's ledger (see feed) so a crash
+        loses none of them, but the queue may show them running for up to
+        batch_wait seconds after they finish.  queues of many short jobs on
+        local disk, where fsync is the bottleneck, gain the most.
+
+      batch_jobs : n (default 8)
+
+        the most finished jobs a feeder holds back - never more than its
+        max_feed.
+
+      batch_wait : seconds (default 1.0)
+
+        the longest a finished job is held back.
+
+    examples :
+
+      0) trade a little crash safety for throughput
+
+        ~ > rq q configure durability=batched batch_jobs=16
 
 
   snapshot, p :
@@ -864,6 +983,13 @@ MODES
     running even acroess machine reboots without requiring sysad intervention
     to add an entry to the machine's startup tasks.
 
+    a feeder does not wait for the queue's lock to record a job as finished.
+    the job is noted in a ledger, ~/.rq/<qpath>/ledger.<host>, which is synced
+    to local disk at once, and its slot is free to run another.  the ledger is
+    written to the queue - with one update - the next time the feeder takes
+    the lock, and is cleared once that commits.  a feeder that crashes writes
+    whatever its ledger holds as the first thing it does when started again.
+
 
     examples :
 
@@ -114,8 +114,21 @@ unless defined? $__rq_util__
 #--}}}
       end
       export 'timestamp'
+      def monotonic
+#--{{{
+      #
+      # seconds since some fixed point which, unlike Time::now, never jumps
+      # when the clock is stepped
+      #
+        Process::clock_gettime(Process::CLOCK_MONOTONIC)
+      rescue NameError
+        Time::now.to_f
+#--}}}
+      end
+      export 'monotonic'
       def stamptime string, local = true 
 #--{{{
+        return string if Time === string
         string = "#{ string }"
         pat = %r/^\s*(\d\d\d\d)-(\d\d)-(\d\d) (\d\d):(\d\d):(\d\d).(\d\d\d\d\d\d)\s*$/o
         match = pat.match string